@@ -0,0 +1,588 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Load generator for the web server. Every connection has at most one
+// request outstanding. In closed-loop mode (the default) a connection sends
+// its next request as soon as the last response is in; in open-loop mode
+// (-R) requests are sent on a fixed schedule, and latency is measured from
+// when a request was due rather than when it went out, so a stalled server
+// can't hide its queueing delay. Only talks to 127.0.0.1.
+
+#define MAX_EVENTS 1024
+#define READ_BUF_SIZE (64*1024)
+#define MAX_RESPONSE_HEADERS 8192
+
+// Latency histogram buckets: values below HIST_SUB_BUCKETS*2 are counted
+// exactly, above that every power of two is split into HIST_SUB_BUCKETS
+// buckets, so each bucket is within 1/HIST_SUB_BUCKETS of its value
+#define HIST_SUB_BUCKETS 64
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 64)
+
+// Command line settings
+int port = 3000;
+int concurrency = 32;
+int num_threads = 1;
+int duration = 10;
+// requests per second over all connections, 0 for closed-loop
+double rate = 0;
+bool keep_alive = true;
+
+// One file in the request mix and how often it is picked
+struct target {
+    string path;
+    int weight;
+    string request;
+};
+vector<target> targets;
+int total_weight = 0;
+
+// HDR-style histogram of latencies in microseconds
+struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    long long max;
+};
+
+// One connection to the server and the request it has outstanding
+struct client {
+    int fd;
+    struct bench_thread *t;
+    bool connected;
+    // request being written and how much of it went out
+    const string *out;
+    size_t out_sent;
+    // headers of the response read so far, and body bytes still to come
+    string head;
+    bool in_body;
+    size_t body_left;
+    int status;
+    bool server_closes;
+    // when the outstanding request was due (open-loop) or sent (closed-loop)
+    long long started;
+    bool busy;
+    // open-loop: when the next request is due
+    long long next_due;
+};
+
+// Each thread drives its share of the connections with its own epoll set
+// and keeps its own counters, which are merged at the end
+struct bench_thread {
+    int epoll_fd;
+    vector<client> clients;
+    histogram hist;
+    unsigned long requests;
+    unsigned long non_2xx;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned long long rng;
+    thread th;
+};
+
+// Return error message after setting errno
+void showError(string s) {
+    perror(s.c_str());
+    exit(1);
+}
+
+// Microseconds on a monotonic clock
+static inline long long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Bucket a value falls into
+static inline int histIndex(long long v) {
+    if (v < 0)
+        v = 0;
+    if (v < HIST_SUB_BUCKETS * 2)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - 6;
+    int index = (shift + 1) * HIST_SUB_BUCKETS + (int)(v >> shift) - HIST_SUB_BUCKETS;
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Largest value that falls into a bucket
+static inline long long histValue(int index) {
+    if (index < HIST_SUB_BUCKETS * 2)
+        return index;
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    long long sub = index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histRecord(histogram &h, long long v) {
+    h.counts[histIndex(v)]++;
+    h.total++;
+    if (v > h.max)
+        h.max = v;
+}
+
+void histMerge(histogram &into, const histogram &from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into.counts[i] += from.counts[i];
+    into.total += from.total;
+    if (from.max > into.max)
+        into.max = from.max;
+}
+
+// Value at or below which the given fraction of the recorded values fall
+long long histPercentile(const histogram &h, double fraction) {
+    if (h.total == 0)
+        return 0;
+    unsigned long want = (unsigned long)(fraction * h.total + 0.5);
+    if (want == 0)
+        want = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h.counts[i];
+        if (seen >= want)
+            return histValue(i) < h.max ? histValue(i) : h.max;
+    }
+    return h.max;
+}
+
+// xorshift64, each thread has its own state
+static inline unsigned long long nextRandom(unsigned long long &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Pick the next file to request according to the mix weights
+const target &pickTarget(bench_thread *t) {
+    int pick = nextRandom(t->rng) % total_weight;
+    for (size_t i = 0; i < targets.size(); i++) {
+        pick -= targets[i].weight;
+        if (pick < 0)
+            return targets[i];
+    }
+    return targets.back();
+}
+
+// Parse "path:weight,path:weight,..." into the request mix. The weight
+// defaults to 1.
+void parseMix(const string &mix) {
+    size_t start = 0;
+    while (start <= mix.length()) {
+        size_t comma = mix.find(',', start);
+        if (comma == string::npos)
+            comma = mix.length();
+        string item = mix.substr(start, comma - start);
+        start = comma + 1;
+        if (item.empty())
+            continue;
+        target tg;
+        size_t colon = item.rfind(':');
+        tg.weight = 1;
+        if (colon != string::npos) {
+            tg.weight = atoi(item.c_str() + colon + 1);
+            item = item.substr(0, colon);
+        }
+        if (tg.weight <= 0)
+            showError("invalid weight in file mix");
+        tg.path = (item[0] == '/') ? item : "/" + item;
+        tg.request = "GET " + tg.path + " HTTP/1.1\r\nHost: localhost\r\n" +
+                     (keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+        total_weight += tg.weight;
+        targets.push_back(tg);
+    }
+    if (targets.empty())
+        showError("empty file mix");
+}
+
+// Start a non-blocking connect to the server
+bool openConnection(client *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->connected = false;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->t->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void closeClient(client *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->connected = false;
+}
+
+// Write as much of the outstanding request as the socket takes. Returns
+// false if the connection failed.
+bool flushRequest(client *c) {
+    while (c->connected && c->out_sent < c->out->length()) {
+        ssize_t n = send(c->fd, c->out->data() + c->out_sent, c->out->length() - c->out_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    return true;
+}
+
+// Issue the next request on a client, due at the given time. Opens a new
+// connection first if there is none.
+void sendRequest(client *c, long long due) {
+    c->started = due;
+    c->busy = true;
+    c->out = &pickTarget(c->t).request;
+    c->out_sent = 0;
+    c->head.clear();
+    c->in_body = false;
+    c->body_left = 0;
+    c->server_closes = false;
+    if (c->fd < 0 && !openConnection(c)) {
+        c->t->errors++;
+        c->busy = false;
+        return;
+    }
+    if (!flushRequest(c)) {
+        c->t->errors++;
+        closeClient(c);
+        c->busy = false;
+    }
+}
+
+// A request failed; drop the connection so the next request starts fresh
+void failRequest(client *c) {
+    c->t->errors++;
+    c->busy = false;
+    closeClient(c);
+}
+
+// Parse the status line and the headers that matter once the header block
+// is complete. Returns false for a malformed response.
+bool parseResponseHead(client *c, size_t head_len) {
+    const string &h = c->head;
+    if (h.compare(0, 9, "HTTP/1.1 ") != 0 && h.compare(0, 9, "HTTP/1.0 ") != 0)
+        return false;
+    c->status = atoi(h.c_str() + 9);
+    c->body_left = 0;
+    // everything but 304s carries a Content-Length
+    for (size_t pos = h.find('\n'); pos != string::npos && pos < head_len; pos = h.find('\n', pos + 1)) {
+        if (strncasecmp(h.c_str() + pos + 1, "Content-Length:", 15) == 0)
+            c->body_left = strtoull(h.c_str() + pos + 16, NULL, 10);
+        else if (strncasecmp(h.c_str() + pos + 1, "Connection: close", 17) == 0)
+            c->server_closes = true;
+    }
+    return true;
+}
+
+// Account for a finished response and move on to the next request
+void finishResponse(client *c, long long now) {
+    bench_thread *t = c->t;
+    t->requests++;
+    if (c->status < 200 || c->status > 299)
+        t->non_2xx++;
+    histRecord(t->hist, now - c->started);
+    c->busy = false;
+    if (!keep_alive || c->server_closes)
+        closeClient(c);
+
+    if (rate <= 0) {
+        sendRequest(c, now);
+    } else if (c->next_due <= now) {
+        // running behind schedule: the time spent waiting counts as latency
+        long long due = c->next_due;
+        c->next_due += (long long)(concurrency * 1000000.0 / rate);
+        sendRequest(c, due);
+    }
+}
+
+// Read whatever the server sent. Returns false if the connection failed.
+bool readResponse(client *c, char *buf) {
+    while (true) {
+        ssize_t n = read(c->fd, buf, READ_BUF_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n <= 0)
+            return false;
+        c->t->bytes += n;
+        if (!c->busy)
+            return false;
+
+        size_t used = 0;
+        while (used < (size_t)n && c->busy) {
+            if (!c->in_body) {
+                size_t old_len = c->head.length();
+                c->head.append(buf + used, n - used);
+                size_t end = c->head.find("\r\n\r\n", old_len >= 3 ? old_len - 3 : 0);
+                if (end == string::npos) {
+                    if (c->head.length() > MAX_RESPONSE_HEADERS)
+                        return false;
+                    used = n;
+                    break;
+                }
+                size_t head_len = end + 4;
+                if (!parseResponseHead(c, head_len))
+                    return false;
+                used += head_len - old_len;
+                c->in_body = true;
+            }
+            size_t take = (size_t)n - used < c->body_left ? (size_t)n - used : c->body_left;
+            c->body_left -= take;
+            used += take;
+            if (c->body_left == 0) {
+                bool closes = !keep_alive || c->server_closes;
+                finishResponse(c, nowUs());
+                // the next request goes out on a fresh connection
+                if (closes)
+                    return true;
+            }
+        }
+        // bytes past the response we were waiting for
+        if (used < (size_t)n)
+            return false;
+    }
+}
+
+// Handle one epoll event for a client
+void handleEvent(client *c, uint32_t events, char *buf) {
+    int fd = c->fd;
+    if (!c->connected && (events & EPOLLOUT) && !(events & EPOLLERR)) {
+        c->connected = true;
+        if (!flushRequest(c)) {
+            failRequest(c);
+            return;
+        }
+    }
+    if (events & EPOLLERR) {
+        failRequest(c);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        if (!flushRequest(c)) {
+            failRequest(c);
+            return;
+        }
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        if (!readResponse(c, buf)) {
+            if (c->busy)
+                failRequest(c);
+            else if (c->fd == fd)
+                closeClient(c);
+        }
+    }
+}
+
+// Event loop for one benchmark thread
+void runThread(bench_thread *t, long long start, long long end) {
+    char *buf = new char[READ_BUF_SIZE];
+    long long interval = rate > 0 ? (long long)(concurrency * 1000000.0 / rate) : 0;
+
+    // In open-loop mode connections take turns, spread evenly over the
+    // first interval
+    for (size_t i = 0; i < t->clients.size(); i++) {
+        client *c = &t->clients[i];
+        if (rate > 0) {
+            c->next_due = start + (long long)(c - &t->clients[0]) * interval / t->clients.size();
+        } else {
+            sendRequest(c, nowUs());
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        long long now = nowUs();
+        if (now >= end)
+            break;
+        // Send open-loop requests that have come due, and sleep until the
+        // next one
+        long long wake = end;
+        if (rate > 0) {
+            for (size_t i = 0; i < t->clients.size(); i++) {
+                client *c = &t->clients[i];
+                if (!c->busy && c->next_due <= now) {
+                    long long due = c->next_due;
+                    c->next_due += interval;
+                    sendRequest(c, due);
+                }
+                if (!c->busy && c->next_due < wake)
+                    wake = c->next_due;
+            }
+        } else {
+            // reconnect closed-loop clients whose request failed
+            for (size_t i = 0; i < t->clients.size(); i++) {
+                if (!t->clients[i].busy)
+                    sendRequest(&t->clients[i], now);
+            }
+            if (wake > now + 100000)
+                wake = now + 100000;
+        }
+        int timeout = (int)((wake - now + 999) / 1000);
+        int n = epoll_wait(t->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            showError("epoll_wait failed");
+        }
+        for (int i = 0; i < n; i++)
+            handleEvent((client*)events[i].data.ptr, events[i].events, buf);
+    }
+    for (size_t i = 0; i < t->clients.size(); i++)
+        closeClient(&t->clients[i]);
+    delete[] buf;
+}
+
+// Print a byte count with a binary unit
+string formatBytes(double bytes) {
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int u = 0;
+    while (bytes >= 1024 && u < 4) {
+        bytes /= 1024;
+        u++;
+    }
+    char buf[64];
+    sprintf(buf, "%.2f %s", bytes, units[u]);
+    return buf;
+}
+
+int main(int argc, char* argv[]) {
+    string mix = "index.html";
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:t:d:R:Km:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                if (port <= 0 || port > 65535)
+                    showError("invalid port");
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                if (concurrency <= 0)
+                    showError("invalid concurrency");
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads <= 0)
+                    showError("invalid number of threads");
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                if (duration <= 0)
+                    showError("invalid duration");
+                break;
+            case 'R':
+                rate = atof(optarg);
+                if (rate <= 0)
+                    showError("invalid request rate");
+                break;
+            case 'K':
+                keep_alive = false;
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-c connections] [-t threads] [-d seconds] "
+                        "[-R requests_per_sec] [-K] [-m path:weight,...]\n", argv[0]);
+                exit(1);
+        }
+    }
+    parseMix(mix);
+    if (num_threads > concurrency)
+        num_threads = concurrency;
+
+    vector<bench_thread*> threads;
+    for (int i = 0; i < num_threads; i++) {
+        bench_thread *t = new bench_thread();
+        t->epoll_fd = epoll_create1(0);
+        if (t->epoll_fd < 0)
+            showError("failed to create epoll instance");
+        t->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        // connections are split between threads as evenly as possible
+        int count = concurrency / num_threads + (i < concurrency % num_threads ? 1 : 0);
+        t->clients.resize(count);
+        for (int j = 0; j < count; j++) {
+            client *c = &t->clients[j];
+            c->fd = -1;
+            c->t = t;
+            c->connected = false;
+            c->busy = false;
+        }
+        threads.push_back(t);
+    }
+
+    printf("> %s load on 127.0.0.1:%d for %ds: %d connections, %d thread(s), keep-alive %s",
+           rate > 0 ? "open-loop" : "closed-loop", port, duration, concurrency, num_threads,
+           keep_alive ? "on" : "off");
+    if (rate > 0)
+        printf(", %.0f requests/sec", rate);
+    printf("\n> file mix:");
+    for (size_t i = 0; i < targets.size(); i++)
+        printf(" %s (%d/%d)", targets[i].path.c_str(), targets[i].weight, total_weight);
+    printf("\n\n");
+    fflush(stdout);
+
+    long long start = nowUs();
+    long long end = start + (long long)duration * 1000000;
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i]->th = thread(runThread, threads[i], start, end);
+
+    histogram hist;
+    memset(&hist, 0, sizeof(hist));
+    unsigned long requests = 0, non_2xx = 0, errors = 0;
+    unsigned long long bytes = 0;
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->th.join();
+        histMerge(hist, threads[i]->hist);
+        requests += threads[i]->requests;
+        non_2xx += threads[i]->non_2xx;
+        errors += threads[i]->errors;
+        bytes += threads[i]->bytes;
+    }
+    double elapsed = (nowUs() - start) / 1e6;
+
+    printf("> %lu requests in %.2fs, %s read\n", requests, elapsed, formatBytes(bytes).c_str());
+    printf("> requests/sec: %.1f\n", requests / elapsed);
+    printf("> throughput:   %s/s\n", formatBytes(bytes / elapsed).c_str());
+    printf("> latency:      p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n",
+           histPercentile(hist, 0.50) / 1000.0, histPercentile(hist, 0.99) / 1000.0,
+           histPercentile(hist, 0.999) / 1000.0, hist.max / 1000.0);
+    if (non_2xx > 0 || errors > 0)
+        printf("> %lu non-2xx responses, %lu failed requests\n", non_2xx, errors);
+    return 0;
+}
@@ -1,10 +1,12 @@
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <iostream>
 #include <string>
@@ -12,17 +14,105 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <fstream>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <zlib.h>
+#include <linux/io_uring.h>
+#include <poll.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <string_view>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 extern int errno;
 
 #define PORT 3000
-#define BACKLOG 5
+#define MAX_EVENTS 1024
+#define MAX_REQUEST_SIZE 8192
+// Pipelined requests parsed ahead of the response being written
+#define MAX_PIPELINE 16
+// Largest file kept in the hot-file cache, bigger files go out with sendfile()
+#define MAX_CACHED_FILE (256*1024)
+// Request headers accepted per request
+#define MAX_HEADERS 64
+// Ranges honored in one Range header, more than that gets the whole file
+#define MAX_RANGES 16
+// iovecs needed for the in-memory part of any response
+#define RESPONSE_IOVS (2*MAX_RANGES + 4)
+// Bytes handed to one sendfile() call, and bytes a connection may write in
+// one pass of the event loop before other connections get a turn
+#define SENDFILE_CHUNK (256*1024)
+#define WRITE_BUDGET (1024*1024)
+// Connection deadlines are kept in a hierarchical timer wheel: WHEEL_LEVELS
+// levels of WHEEL_SLOTS slots, the first level one TIMER_TICK_MS tick per slot
+// and each level above it WHEEL_SLOTS times coarser
+#define TIMER_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+// Largest text file compressed on the fly
+#define MAX_COMPRESSED_FILE (1024*1024)
+// How long a stat() result is trusted, and how many paths a worker remembers
+#define STAT_CACHE_TTL_MS 1000
+#define STAT_CACHE_SIZE 4096
+// Access log: records each worker can queue before the writer catches up,
+// text carried per record, and bytes the writer collects per write()
+#define LOG_RING_SLOTS 4096
+#define LOG_TEXT_SIZE 256
+#define LOG_BATCH_SIZE (64*1024)
+// Live counters served at STATS_PATH: status codes counted individually, and
+// latency histograms with power-of-two buckets from 1ns up to about 18 minutes
+#define STATS_PATH "/__stats"
+#define MAX_STATUS 600
+#define LATENCY_BUCKETS 41
 
-// Global server variable to gracefully handler ctrl-c to terminate server
-int server_fd;
+// io_uring backend sizing, per worker: submission queue entries, fixed file
+// slots for client sockets, and registered buffers used to stream file bodies
+#define URING_ENTRIES 1024
+#define URING_MAX_FILES 16384
+#define URING_CHUNKS 64
+#define URING_CHUNK_SIZE (64*1024)
+
+// Listen backlog, can be changed with -b <backlog>
+int backlog = SOMAXCONN;
+
+// Number of worker threads (-w), defaults to one per core
+int num_workers = 0;
+// Pin each worker to its own core (-a)
+bool pin_workers = false;
+
+// Serve with the io_uring backend instead of epoll (-u)
+bool use_uring = false;
+
+// Bytes of file data each worker may cache (-c <MB>, 0 turns caching off)
+size_t cache_capacity = 32*1024*1024;
+
+// Bytes of compressed responses each worker may cache (-z <MB>, 0 turns
+// compressing on the fly off; precompressed .gz files are still served)
+size_t compressed_capacity = 8*1024*1024;
+
+// Bumped by SIGUSR1, each worker then prints its cache counters
+atomic<int> stats_requested(0);
+
+// What gets logged to stdout (-v): 0 nothing, 1 one access log line per
+// response, 2 also connections and the raw requests and response headers
+int log_level = 1;
 
 // Define constant MIME types for response
 string HTML =   "Content-Type: text/html\r\n";
@@ -30,15 +120,381 @@ string JPG =    "Content-Type: image/jpeg\r\n";
 string PNG =    "Content-Type: image/png\r\n";
 string TXT =    "Content-Type: text/plain\r\n";
 string BINARY = "Content-Type: application/octet-stream\r\n";
+string JSON =   "Content-Type: application/json\r\n";
 
 // Response headers
-string PAGE_NOT_FOUND = "HTTP/1.1 404 Not Found\r\n" + HTML + "\r\n" +
-                        "<!doctype HTML>\n<html>\n<head><title> 404: File Not Found\
+string NOT_FOUND_STATUS = "HTTP/1.1 404 Not Found\r\n";
+string PAGE_NOT_FOUND = "<!doctype HTML>\n<html>\n<head><title> 404: File Not Found\
                         </title></head>\n\n<body><h1> 404 File NOT Found.</h1><p> The requested\
                         file could not be found. Please try again.</p></body>\n</html>\n";
+string BAD_REQUEST_STATUS = "HTTP/1.1 400 Bad Request\r\n";
+string PAGE_BAD_REQUEST = "<!doctype HTML>\n<html>\n<head><title> 400: Bad Request</title></head>\n\n\
+<body><h1> 400 Bad Request.</h1><p> The server could not understand the request.</p></body>\n</html>\n";
+string HEADERS_TOO_LARGE_STATUS = "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+string PAGE_HEADERS_TOO_LARGE = "<!doctype HTML>\n<html>\n<head><title> 431: Request Header Fields Too Large\
+</title></head>\n\n<body><h1> 431 Request Header Fields Too Large.</h1></body>\n</html>\n";
+string SERVICE_UNAVAILABLE_STATUS = "HTTP/1.1 503 Service Unavailable\r\n";
+string PAGE_SERVICE_UNAVAILABLE = "<!doctype HTML>\n<html>\n<head><title> 503: Service Unavailable</title></head>\n\n\
+<body><h1> 503 Service Unavailable.</h1><p> The server is too busy, please try again.</p></body>\n</html>\n";
+string NOT_IMPLEMENTED_STATUS = "HTTP/1.1 501 Not Implemented\r\n";
+string PAGE_NOT_IMPLEMENTED = "<!doctype HTML>\n<html>\n<head><title> 501: Not Implemented</title></head>\n\n\
+<body><h1> 501 Not Implemented.</h1><p> Only GET requests are supported.</p></body>\n</html>\n";
+string RANGE_NOT_SATISFIABLE_STATUS = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+string PAGE_RANGE_NOT_SATISFIABLE = "<!doctype HTML>\n<html>\n<head><title> 416: Range Not Satisfiable\
+</title></head>\n\n<body><h1> 416 Range Not Satisfiable.</h1></body>\n</html>\n";
 string OK_STATUS = "HTTP/1.1 200 OK\r\n";
+string PARTIAL_CONTENT_STATUS = "HTTP/1.1 206 Partial Content\r\n";
+string NOT_MODIFIED_STATUS = "HTTP/1.1 304 Not Modified\r\n";
+string ACCEPT_RANGES = "Accept-Ranges: bytes\r\n";
+string GZIP_ENCODING = "Content-Encoding: gzip\r\n";
+string DEFLATE_ENCODING = "Content-Encoding: deflate\r\n";
+string VARY_ENCODING = "Vary: Accept-Encoding\r\n";
 string CLOSED_CONNECTION = "Connection: close\r\n";
+string KEEP_ALIVE = "Connection: keep-alive\r\n";
 string SERVER_NAME = "Server: Arnav/1.0\r\n";
+string NO_STORE = "Cache-Control: no-store\r\n";
+
+// Connection headers plus the blank line ending the header block, built once
+// the keep-alive options are known
+string closeHeaders;
+string keepAliveHeaders;
+
+// Separates the parts of multipart/byteranges responses, picked at startup
+string rangeBoundary;
+
+// Complete response sent to clients turned away when the server is full
+string serviceUnavailable;
+
+// Keep-alive settings: seconds an idle connection is kept open (-k) and
+// requests served on one connection before it is closed (-r)
+int keepalive_timeout = 5;
+int max_requests = 100;
+
+// Seconds a client gets to send a request's headers once it has started
+// (-T), and to accept more of a response before it is dropped (-s)
+int header_timeout = 10;
+int write_timeout = 30;
+
+// Open connections allowed over all workers (-m); clients past the limit
+// get a 503 and are closed straight away
+int max_connections = 10000;
+
+// States a client connection moves through in the event loop
+enum conn_state {
+    READ_REQUEST,
+    WRITE_HEADERS,
+    WRITE_BODY,
+    CLOSE_CONN
+};
+
+struct connection;
+struct uring;
+
+// Ready-made response for a cached file: everything but the connection
+// headers, and the file data. Shared with in-flight responses so an entry
+// can be evicted while it is still being sent.
+struct cached_file {
+    string head;
+    string body;
+    // validators of the file the body was read from
+    string etag;
+    time_t mtime;
+};
+
+// One entry in a worker's hot-file cache
+struct cache_entry {
+    string path;
+    shared_ptr<const cached_file> file;
+    // inotify watch, or -1 if the entry is checked against st_mtime instead
+    int wd;
+    time_t mtime;
+    list<cache_entry*>::iterator lru_pos;
+};
+
+// Result of a stat() call: 0 and the file's info, or the errno it failed with
+struct stat_entry {
+    int err;
+    struct stat info;
+    long long fetched;
+};
+
+// Size-bounded LRU cache of small files, one per worker so it needs no locks
+struct file_cache {
+    unordered_map<string, cache_entry*> entries;
+    // inotify watches map to every cached path of the watched file
+    unordered_multimap<int, cache_entry*> watches;
+    // most recently used first
+    list<cache_entry*> lru;
+    size_t bytes;
+    int inotify_fd;
+    atomic<unsigned long> hits;
+    atomic<unsigned long> misses;
+    // recent stat() results by path, trusted for STAT_CACHE_TTL_MS
+    unordered_map<string, stat_entry> stats;
+};
+
+enum log_kind {
+    // a finished response, written out as an access log line
+    LOG_ACCESS,
+    // a piece of free-form debug text, long messages span several records
+    LOG_TEXT
+};
+
+// One access log record, filled in by a worker and formatted by the writer
+struct log_record {
+    log_kind kind;
+    time_t when;
+    int status;
+    size_t bytes;
+    long long usecs;
+    char ip[INET_ADDRSTRLEN];
+    // request line for LOG_ACCESS, or the debug text
+    unsigned short len;
+    char text[LOG_TEXT_SIZE];
+};
+
+// Single-producer single-consumer ring between a worker and the log writer
+// thread. The worker only moves tail and the writer only moves head, so
+// neither side takes a lock; when the ring is full records are dropped.
+struct log_ring {
+    log_record slots[LOG_RING_SLOTS];
+    atomic<size_t> head;
+    atomic<size_t> tail;
+    atomic<unsigned long> dropped;
+};
+
+// A text file compressed for one content coding. file is NULL if the file
+// didn't get any smaller, in which case it is sent as is.
+struct compressed_entry {
+    string key;
+    shared_ptr<const cached_file> file;
+    // entity tag of the file that was compressed
+    string source_etag;
+    list<compressed_entry*>::iterator lru_pos;
+};
+
+// Size-bounded LRU cache of compressed text files, keyed by path and coding.
+// Entries are checked against the file's current entity tag on every hit.
+struct compressed_cache {
+    unordered_map<string, compressed_entry*> entries;
+    list<compressed_entry*> lru;
+    size_t bytes;
+    atomic<unsigned long> hits;
+    atomic<unsigned long> misses;
+};
+
+// Phases of a request that are timed for the stats endpoint
+enum latency_phase {
+    // parsing the request line and headers
+    PHASE_PARSE,
+    // stat'ing and opening a file that wasn't cached
+    PHASE_OPEN,
+    // from the first write of the response until it's all written
+    PHASE_SEND,
+    // from the request being parsed until the response is all written
+    PHASE_TOTAL,
+    NUM_PHASES
+};
+
+// Latency histogram: bucket b counts times of [2^(b-1), 2^b) nanoseconds,
+// bucket 0 those under a nanosecond
+struct latency_histogram {
+    atomic<unsigned long> counts[LATENCY_BUCKETS];
+    atomic<unsigned long long> sum_ns;
+};
+
+// Counters for the stats endpoint. Each worker only ever updates its own,
+// with plain relaxed loads and stores, and the endpoint adds up every
+// worker's when it's read, so counting costs nothing on the request path.
+struct worker_stats {
+    // finished responses by status code
+    atomic<unsigned long> status[MAX_STATUS];
+    atomic<unsigned long long> bytes;
+    latency_histogram latency[NUM_PHASES];
+};
+
+// Which deadline a connection's timer stands for
+enum deadline_kind {
+    DEADLINE_NONE,
+    // the headers of a request have started arriving but aren't complete
+    DEADLINE_HEADER,
+    // nothing to do until the client sends another request
+    DEADLINE_IDLE,
+    // responses are waiting for the client to read them
+    DEADLINE_WRITE
+};
+
+// Hierarchical timer wheel holding one timer per connection. A timer goes in
+// the level whose span covers how far off it is, in the slot picked by the
+// bits of its expiry tick for that level. Each time a level wraps around,
+// the next slot of the level above is moved down, so arming, re-arming and
+// cancelling a timer are all O(1).
+struct timer_wheel {
+    list<connection*> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    // last tick that has been processed
+    long long tick;
+};
+
+// Each worker owns a SO_REUSEPORT listening socket and its own event loop,
+// so workers never share connections or take locks on the request path
+struct worker {
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    thread t;
+    // deadlines of the open connections, and how many there are
+    timer_wheel timers;
+    atomic<int> connections;
+    // clients turned away with a 503
+    atomic<unsigned long> rejected;
+    // connections that used up their write budget while the socket could
+    // still take more, written again on the next pass of the loop
+    list<connection*> ready;
+    file_cache cache;
+    compressed_cache compressed;
+    worker_stats stats;
+    int stats_seen;
+    // io_uring backend state, NULL when the worker uses epoll
+    uring *ring;
+    // access log records on their way to the writer thread
+    log_ring *log;
+};
+
+// Global list of workers to gracefully handler ctrl-c to terminate server
+vector<worker*> workers;
+
+// A header from the request, pointing into the connection's read buffer
+struct http_header {
+    string_view name;
+    string_view value;
+};
+
+// A parsed request. Every field points into the connection's read buffer,
+// so nothing is copied and the views are only valid until the buffer moves.
+struct http_request {
+    string_view method;
+    string_view path;
+    // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int minor_version;
+    http_header headers[MAX_HEADERS];
+    int num_headers;
+    // the raw request, request line through the blank line
+    string_view raw;
+};
+
+// Outcome of trying to parse a request out of the read buffer
+enum parse_result {
+    PARSE_OK,
+    PARSE_INCOMPLETE,
+    PARSE_BAD_REQUEST,
+    PARSE_TOO_LARGE,
+    PARSE_NOT_IMPLEMENTED
+};
+
+// One range of a 206 response: the text sent in front of it (the multipart
+// boundary and part headers, empty for a single range) and the file bytes
+struct body_part {
+    string text;
+    off_t off;
+    size_t len;
+};
+
+// One response waiting to be written, in the order requests arrived
+struct response {
+    string headers;
+    // cached file sent from memory after the headers, NULL if none
+    shared_ptr<const cached_file> cached;
+    // how much of the in-memory part (headers and cached file) has been written
+    size_t sent;
+    // file being sent as the body, -1 when there is no body
+    int file_fd;
+    off_t file_off;
+    size_t file_left;
+    // close the connection once this response is out
+    bool close_after;
+    // Range and If-Range from the request, and for a 206 the ranges being
+    // sent. Ranges of a cached file all go out with the headers; for other
+    // files `part` is the range whose text and body are being written.
+    string range;
+    string if_range;
+    // If-None-Match and If-Modified-Since from the request
+    string if_none_match;
+    string if_modified_since;
+    vector<body_part> parts;
+    size_t part;
+    // Content-Encoding and Vary headers for files that can be compressed,
+    // sent after a cached file's head
+    string encoding_headers;
+    // for the access log: the request line, when the request was parsed and
+    // bytes written so far, then when the file started to be opened and the
+    // response started to be written, 0 until then
+    string request_line;
+    long long started;
+    size_t written;
+    long long open_started;
+    long long send_started;
+    // io_uring backend: the file still has to be opened before anything can
+    // be written
+    bool opening;
+    string path;
+};
+
+// Per-client connection info
+struct connection {
+    int fd;
+    conn_state state;
+    worker *w;
+    // bytes read from the client; everything before `parsed` has been turned
+    // into responses, and the search for the end of the next request resumes
+    // at `scanned` so partial reads are never rescanned
+    string request;
+    size_t parsed;
+    size_t scanned;
+    // responses for pipelined requests, the front one is being written
+    deque<response> responses;
+    // number of requests received on this connection
+    int requests;
+    // client shut down its side, or we stopped reading after Connection: close
+    bool peer_closed;
+    bool closing;
+    // current deadline, as a tick of the worker's timer wheel, and the
+    // connection's place in the wheel
+    deadline_kind deadline;
+    long long expires;
+    list<connection*> *timer_list;
+    list<connection*>::iterator timer_pos;
+    // bytes were written since the deadline was last set
+    bool progress;
+    // bytes of finished responses that were still in the socket's send
+    // buffer when the deadline was last checked
+    int unsent;
+    // pipe used by the splice() fallback, and bytes still sitting in it
+    int pipe_fds[2];
+    size_t pipe_bytes;
+    // place in w->ready while waiting for another turn to write
+    bool in_ready;
+    list<connection*>::iterator ready_pos;
+    char ip[INET_ADDRSTRLEN];
+
+    // io_uring backend: fd is a fixed file slot rather than a real fd, and
+    // the connection is only freed once no operation refers to it
+    int inflight;
+    bool dead;
+    bool recv_armed;
+    bool write_busy;
+    bool open_submitted;
+    int open_fd;
+    char *recv_buf;
+    struct statx stx;
+    struct msghdr msg;
+    struct iovec iov[RESPONSE_IOVS];
+    // buffer holding the file chunk being sent: a registered buffer index,
+    // or -1 with heap_chunk used instead
+    int chunk;
+    char *heap_chunk;
+    size_t chunk_len;
+    size_t chunk_sent;
+};
 
 // Return error message after setting errno
 void showError(string s) {
@@ -46,36 +502,255 @@ void showError(string s) {
     exit(1);
 }
 
-// Send simple 404 page html as server response
-void page404(int fd) {
-    write(fd, PAGE_NOT_FOUND.c_str(), PAGE_NOT_FOUND.length());
+// Build the status line, server name, content-type and content-length. The
+// connection headers are added separately so cached files can share one block.
+string buildHeaders(const string &status, const string &contentType, long long length) {
+    // header for content-length
+    char len[100];
+    sprintf(len, "Content-Length: %lld\r\n", length);
+    string contentLen(len);
+
+    return status + SERVER_NAME + contentType + contentLen;
+}
+
+// Connection headers that finish off the response's header block
+const string &connectionHeaders(const response &r) {
+    return r.close_after ? closeHeaders : keepAliveHeaders;
+}
+
+// Queue a small html error page as server response
+void errorPage(response &r, const string &status, const string &page) {
+    r.headers = buildHeaders(status, HTML, page.length()) + connectionHeaders(r) + page;
+    r.file_left = 0;
+}
+
+// Queue simple 404 page html as server response
+void page404(response &r) {
+    errorPage(r, NOT_FOUND_STATUS, PAGE_NOT_FOUND);
 }
 
-// handler for sigaction 
+// handler for sigaction
 void sighandler(int s) {
+    (void)s;
     printf(" Closing server\n");
-    close(s);
+    for (size_t i = 0; i < workers.size(); i++)
+        close(workers[i]->listen_fd);
     exit(0);
 }
 
-// Extract file name from input buffer
-string parseFileName(char* buffer) {
-    const char slash = '/';
+// Find the first occurrence of c in [p, end), or end if there is none.
+// Scans 32 or 16 bytes at a time with AVX2/SSE2 when they are available.
+static inline const char *findChar(const char *p, const char *end, char c) {
+#if defined(__AVX2__)
+    __m256i needle32 = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i needle16 = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != c)
+        p++;
+    return p;
+}
+
+// Find the first space, control character or DEL in [p, end), or end if
+// there is none. Bytes >= 0x80 are allowed through.
+static inline const char *findDelimiter(const char *p, const char *end) {
+#if defined(__SSE2__)
+    const __m128i first_printable = _mm_set1_epi8(0x21);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        // unsigned chunk >= 0x21 is the same as max(chunk, 0x21) == chunk
+        __m128i printable = _mm_cmpeq_epi8(_mm_max_epu8(chunk, first_printable), chunk);
+        __m128i bad = _mm_or_si128(_mm_andnot_si128(printable, _mm_set1_epi8(-1)),
+                                   _mm_cmpeq_epi8(chunk, del));
+        unsigned mask = _mm_movemask_epi8(bad);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && (unsigned char)*p >= 0x21 && *p != 0x7f)
+        p++;
+    return p;
+}
 
-    char* pos = strchr(buffer, slash);
-    int buf_len = strlen(pos);
+// Characters allowed in a method or header name (RFC 7230 token)
+static inline bool isTokenChar(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+           (ch != 0 && strchr("!#$%&'*+-.^_`|~", ch) != NULL);
+}
 
-    string name = "";
-    for (int i = 1; i < buf_len; i++) {
-        if (pos[i] == ' ')
+// Find the end of the header block in buf, resuming the search at *scanned.
+// Returns the length of the request including the blank line, or 0 if the
+// blank line hasn't arrived yet.
+size_t findRequestEnd(const char *buf, size_t len, size_t *scanned) {
+    const char *end = buf + len;
+    const char *p = buf + *scanned;
+    while ((p = findChar(p, end, '\n')) < end) {
+        // a blank line is "\n\n" or "\n\r\n"
+        if (p + 1 < end && p[1] == '\n')
+            return p + 2 - buf;
+        if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+            return p + 3 - buf;
+        // the rest of the terminator hasn't arrived, look at this \n again later
+        if (p + 2 >= end)
             break;
-        name += pos[i];
+        p++;
     }
+    *scanned = p - buf;
+    return 0;
+}
 
-    return name;
+// Split one line off [*p, end), without its \r\n or \n
+static inline string_view nextLine(const char *&p, const char *end) {
+    const char *nl = findChar(p, end, '\n');
+    const char *line_end = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+    string_view line(p, line_end - p);
+    p = (nl < end) ? nl + 1 : end;
+    return line;
 }
 
-// Find file type and return 
+// Parse and validate a complete request header block of length len
+parse_result parseHttpRequest(const char *buf, size_t len, http_request &req) {
+    const char *p = buf;
+    const char *end = buf + len;
+    req.raw = string_view(buf, len);
+    req.num_headers = 0;
+
+    // Request line: METHOD SP path SP HTTP/1.x
+    string_view line = nextLine(p, end);
+    const char *l = line.data();
+    const char *l_end = l + line.length();
+    const char *sp = findChar(l, l_end, ' ');
+    req.method = string_view(l, sp - l);
+    if (req.method.empty() || sp == l_end)
+        return PARSE_BAD_REQUEST;
+    for (size_t i = 0; i < req.method.length(); i++) {
+        if (!isTokenChar(req.method[i]))
+            return PARSE_BAD_REQUEST;
+    }
+
+    l = sp + 1;
+    sp = findDelimiter(l, l_end);
+    req.path = string_view(l, sp - l);
+    if (req.path.empty() || req.path[0] != '/' || sp == l_end || *sp != ' ')
+        return PARSE_BAD_REQUEST;
+
+    string_view version(sp + 1, l_end - sp - 1);
+    if (version == "HTTP/1.1")
+        req.minor_version = 1;
+    else if (version == "HTTP/1.0")
+        req.minor_version = 0;
+    else
+        return PARSE_BAD_REQUEST;
+
+    // Header lines: name ":" OWS value OWS, up to the blank line
+    while (p < end) {
+        line = nextLine(p, end);
+        if (line.empty())
+            break;
+        if (req.num_headers == MAX_HEADERS)
+            return PARSE_TOO_LARGE;
+        // obsolete line folding is rejected, as RFC 7230 allows
+        if (line[0] == ' ' || line[0] == '\t')
+            return PARSE_BAD_REQUEST;
+        size_t colon = line.find(':');
+        if (colon == string_view::npos || colon == 0)
+            return PARSE_BAD_REQUEST;
+        for (size_t i = 0; i < colon; i++) {
+            if (!isTokenChar(line[i]))
+                return PARSE_BAD_REQUEST;
+        }
+        size_t start = colon + 1;
+        size_t stop = line.length();
+        while (start < stop && (line[start] == ' ' || line[start] == '\t'))
+            start++;
+        while (stop > start && (line[stop - 1] == ' ' || line[stop - 1] == '\t'))
+            stop--;
+        for (size_t i = start; i < stop; i++) {
+            unsigned char ch = line[i];
+            if ((ch < 0x20 && ch != '\t') || ch == 0x7f)
+                return PARSE_BAD_REQUEST;
+        }
+        http_header &h = req.headers[req.num_headers++];
+        h.name = line.substr(0, colon);
+        h.value = line.substr(start, stop - start);
+    }
+
+    if (req.method != "GET")
+        return PARSE_NOT_IMPLEMENTED;
+    return PARSE_OK;
+}
+
+// Decode a hex digit, or -1 if ch isn't one
+static inline int hexValue(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+// Extract file name from the request path: drop the leading '/' and any query
+// string, and decode %XX escapes. Returns false for a malformed escape, and
+// for a name that would leave the served directory: an absolute path or one
+// with a ".." segment, checked after decoding so escapes can't hide them.
+bool parseFileName(string_view path, string &name) {
+    path.remove_prefix(1);
+    size_t query = path.find('?');
+    if (query != string_view::npos)
+        path = path.substr(0, query);
+
+    name.clear();
+    name.reserve(path.length());
+    size_t i = 0;
+    while (i < path.length()) {
+        // copy runs without escapes in one go
+        size_t pct = path.find('%', i);
+        if (pct == string_view::npos)
+            pct = path.length();
+        name.append(path.data() + i, pct - i);
+        i = pct;
+        if (i == path.length())
+            break;
+        if (i + 2 >= path.length())
+            return false;
+        int hi = hexValue(path[i + 1]), lo = hexValue(path[i + 2]);
+        if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
+            return false;
+        name += (char)(hi * 16 + lo);
+        i += 3;
+    }
+
+    if (!name.empty() && name[0] == '/')
+        return false;
+    size_t start = 0;
+    while (start <= name.length()) {
+        size_t slash = name.find('/', start);
+        if (slash == string::npos)
+            slash = name.length();
+        if (name.compare(start, slash - start, "..") == 0)
+            return false;
+        start = slash + 1;
+    }
+    return true;
+}
+
+// Find file type and return
 string parseFileType(string fileName) {
     string extensions[4] = {".html", ".txt", ".jpg", ".png"};
     size_t found;
@@ -97,118 +772,2397 @@ string parseFileType(string fileName) {
     return BINARY;
 }
 
-// Parse client's request, and serve response from server to client
-void parseRequest(int client_fd) {
-    char buffer[8192] = {0};
-    memset(buffer, 0, 8192);
+// Return the value of a request header, matched case-insensitively
+string_view getHeader(const http_request &req, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < req.num_headers; i++) {
+        const http_header &h = req.headers[i];
+        if (h.name.length() == name_len && strncasecmp(h.name.data(), name, name_len) == 0)
+            return h.value;
+    }
+    return string_view();
+}
+
+// Case-insensitive search for a token such as "close" in a header value
+bool headerHasToken(string_view value, const char *token) {
+    size_t token_len = strlen(token);
+    for (size_t i = 0; i + token_len <= value.length(); i++) {
+        if (strncasecmp(value.data() + i, token, token_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// HTTP/1.1 keeps the connection open unless the client asks to close it,
+// HTTP/1.0 closes it unless the client asks for keep-alive
+bool wantsKeepAlive(const http_request &req) {
+    string_view conn = getHeader(req, "Connection");
+    if (headerHasToken(conn, "close"))
+        return false;
+    if (headerHasToken(conn, "keep-alive"))
+        return true;
+    return req.minor_version == 1;
+}
+
+// Format a time as an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+string httpDate(time_t t) {
+    struct tm tm;
+    char buf[64];
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+// Milliseconds on a monotonic clock
+static inline long long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Nanoseconds on a monotonic clock, for timing requests
+static inline long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Add to a counter only its own worker changes. Nothing else writes it, so
+// this needs no atomic read-modify-write, only a store other threads can read.
+template <typename T, typename N>
+static inline void counterAdd(atomic<T> &counter, N n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Count a time in its latency histogram
+static inline void latencyAdd(worker *w, latency_phase phase, long long ns) {
+    latency_histogram &h = w->stats.latency[phase];
+    if (ns < 0)
+        ns = 0;
+    int b = ns == 0 ? 0 : 64 - __builtin_clzll((unsigned long long)ns);
+    if (b >= LATENCY_BUCKETS)
+        b = LATENCY_BUCKETS - 1;
+    counterAdd(h.counts[b], 1);
+    counterAdd(h.sum_ns, ns);
+}
+
+// Claim the next free slot of a worker's log ring, or count the record as
+// dropped if the writer has fallen behind
+static inline log_record *logReserve(log_ring *ring) {
+    size_t tail = ring->tail.load(memory_order_relaxed);
+    if (tail - ring->head.load(memory_order_acquire) >= LOG_RING_SLOTS) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return NULL;
+    }
+    return &ring->slots[tail % LOG_RING_SLOTS];
+}
+
+// Hand the slot returned by logReserve() over to the writer
+static inline void logCommit(log_ring *ring) {
+    ring->tail.store(ring->tail.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Queue debug output (log level 2), formatted like printf. Text that doesn't
+// fit in one record is split over several.
+void logDebug(worker *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logDebug(worker *w, const char *fmt, ...) {
+    if (log_level < 2)
+        return;
+    char buf[MAX_REQUEST_SIZE + 1024];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(buf))
+        len = sizeof(buf) - 1;
+    for (int off = 0; off < len; off += LOG_TEXT_SIZE) {
+        log_record *rec = logReserve(w->log);
+        if (rec == NULL)
+            return;
+        rec->kind = LOG_TEXT;
+        rec->len = (len - off < LOG_TEXT_SIZE) ? len - off : LOG_TEXT_SIZE;
+        memcpy(rec->text, buf + off, rec->len);
+        logCommit(w->log);
+    }
+}
+
+// Format one record into out, returning its length. Access log lines use
+// the Common Log Format followed by the time taken to serve the request.
+size_t formatLogRecord(const log_record &rec, char *out, size_t size) {
+    if (rec.kind == LOG_TEXT) {
+        memcpy(out, rec.text, rec.len);
+        return rec.len;
+    }
+    // the timestamp only changes once a second
+    static thread_local time_t date_when = -1;
+    static thread_local char date[64];
+    if (rec.when != date_when) {
+        struct tm tm;
+        gmtime_r(&rec.when, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        date_when = rec.when;
+    }
+    int n = snprintf(out, size, "%s - - [%s] \"%.*s\" %d %zu %lldus\n", rec.ip, date,
+                     (int)rec.len, rec.text, rec.status, rec.bytes, rec.usecs);
+    return (n < 0) ? 0 : ((size_t)n < size ? n : size - 1);
+}
 
-    // Read data from client into buffer
-    int data_len = read(client_fd, buffer, 8192);
-    if (data_len < 0) {
-        showError("failed to read from client");
+// Write a whole buffer to stdout
+void writeLog(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+// Log writer thread: drains every worker's ring, formatting records into one
+// buffer that goes out with a single write() per batch, and reports records
+// the workers had to drop. Sleeps briefly whenever there is nothing to do.
+void runLogWriter() {
+    static char out[LOG_BATCH_SIZE];
+    size_t used = 0;
+    vector<unsigned long> dropped_seen(workers.size(), 0);
+    while (true) {
+        bool idle = true;
+        for (size_t i = 0; i < workers.size(); i++) {
+            log_ring *ring = workers[i]->log;
+            size_t head = ring->head.load(memory_order_relaxed);
+            size_t tail = ring->tail.load(memory_order_acquire);
+            if (head != tail)
+                idle = false;
+            for (; head != tail; head++) {
+                if (sizeof(out) - used < LOG_TEXT_SIZE + 256) {
+                    writeLog(out, used);
+                    used = 0;
+                }
+                used += formatLogRecord(ring->slots[head % LOG_RING_SLOTS], out + used, sizeof(out) - used);
+            }
+            ring->head.store(head, memory_order_release);
+
+            unsigned long dropped = ring->dropped.load(memory_order_relaxed);
+            if (dropped != dropped_seen[i]) {
+                fprintf(stderr, "> worker %zu: %lu access log records dropped\n", i, dropped - dropped_seen[i]);
+                dropped_seen[i] = dropped;
+            }
+        }
+        if (used > 0) {
+            writeLog(out, used);
+            used = 0;
+        }
+        if (idle)
+            usleep(10000);
+    }
+}
+
+// Entity tag for a file, built from its inode, size and modification time
+string fileETag(const struct stat &fileinfo) {
+    char buf[100];
+    sprintf(buf, "\"%lx-%llx-%llx\"", (unsigned long)fileinfo.st_ino, (unsigned long long)fileinfo.st_size,
+            (unsigned long long)fileinfo.st_mtim.tv_sec * 1000000000ULL + fileinfo.st_mtim.tv_nsec);
+    return buf;
+}
+
+// ETag and Last-Modified headers for a file
+string validatorHeaders(const string &etag, time_t mtime) {
+    return "ETag: " + etag + "\r\nLast-Modified: " + httpDate(mtime) + "\r\n";
+}
+
+// Check an If-None-Match list against an entity tag, using the weak
+// comparison: a W/ prefix is ignored and "*" matches any tag
+bool etagMatches(string_view list, const string &etag) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        string_view tag = list.substr(0, comma);
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+            tag.remove_prefix(1);
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+            tag.remove_suffix(1);
+        if (tag.substr(0, 2) == "W/")
+            tag.remove_prefix(2);
+        if (tag == "*" || tag == etag)
+            return true;
+        if (comma == string_view::npos)
+            break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Parse a decimal number, saturating instead of overflowing. Returns false
+// if s isn't a non-empty run of digits.
+static bool parseNumber(string_view s, unsigned long long &value) {
+    if (s.empty())
+        return false;
+    value = 0;
+    for (size_t i = 0; i < s.length(); i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        if (value < (1ULL << 60))
+            value = value * 10 + (s[i] - '0');
+    }
+    return true;
+}
+
+// Parse a "bytes=" Range header against a file of the given size into the
+// satisfiable ranges. Returns -1 if the header should be ignored (malformed,
+// another unit, or too many ranges), otherwise the number of ranges found,
+// which is 0 when none of them can be satisfied.
+int parseRanges(string_view value, size_t size, vector<body_part> &parts) {
+    if (value.length() < 6 || strncasecmp(value.data(), "bytes=", 6) != 0)
+        return -1;
+    value.remove_prefix(6);
+
+    int specs = 0;
+    while (true) {
+        size_t comma = value.find(',');
+        string_view spec = value.substr(0, comma);
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t'))
+            spec.remove_prefix(1);
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t'))
+            spec.remove_suffix(1);
+
+        // empty list elements are allowed and skipped
+        if (!spec.empty()) {
+            if (++specs > MAX_RANGES)
+                return -1;
+            size_t dash = spec.find('-');
+            if (dash == string_view::npos)
+                return -1;
+            unsigned long long first, last;
+            if (dash == 0) {
+                // "-N" is the last N bytes
+                if (!parseNumber(spec.substr(1), last))
+                    return -1;
+                if (last > 0 && size > 0) {
+                    first = size > last ? size - last : 0;
+                    parts.push_back(body_part{string(), (off_t)first, size - (size_t)first});
+                }
+            } else {
+                // "N-" runs to the end of the file, "N-M" is inclusive
+                if (!parseNumber(spec.substr(0, dash), first))
+                    return -1;
+                if (dash + 1 == spec.length())
+                    last = size - 1;
+                else if (!parseNumber(spec.substr(dash + 1), last) || last < first)
+                    return -1;
+                if (first < size) {
+                    if (last >= size)
+                        last = size - 1;
+                    parts.push_back(body_part{string(), (off_t)first, (size_t)(last - first + 1)});
+                }
+            }
+        }
+        if (comma == string_view::npos)
+            break;
+        value.remove_prefix(comma + 1);
+    }
+    if (specs == 0)
+        return -1;
+    return parts.size();
+}
+
+// Return a recent stat() result for path, or NULL if there is none
+stat_entry *statPeek(file_cache &cache, const string &path) {
+    auto it = cache.stats.find(path);
+    if (it == cache.stats.end() || nowMs() - it->second.fetched >= STAT_CACHE_TTL_MS)
+        return NULL;
+    return &it->second;
+}
+
+// Remember a stat() result for path
+stat_entry *statStore(file_cache &cache, const string &path, int err, const struct stat &fileinfo) {
+    // Stale entries are never looked at again, so rather than tracking
+    // their age just start over once the table fills up
+    if (cache.stats.size() >= STAT_CACHE_SIZE && cache.stats.find(path) == cache.stats.end())
+        cache.stats.clear();
+    stat_entry &entry = cache.stats[path];
+    entry.err = err;
+    entry.info = fileinfo;
+    entry.fetched = nowMs();
+    return &entry;
+}
+
+// stat() a file, answering from the stat cache when the last result is recent
+stat_entry *statCached(file_cache &cache, const string &path) {
+    stat_entry *entry = statPeek(cache, path);
+    if (entry != NULL)
+        return entry;
+    struct stat fileinfo;
+    memset(&fileinfo, 0, sizeof(fileinfo));
+    int err = stat(path.c_str(), &fileinfo) < 0 ? errno : 0;
+    return statStore(cache, path, err, fileinfo);
+}
+
+// Drop an entry from the cache and stop watching its file
+void cacheRemove(file_cache &cache, cache_entry *e) {
+    if (e->wd >= 0) {
+        auto range = cache.watches.equal_range(e->wd);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == e) {
+                cache.watches.erase(it);
+                break;
+            }
+        }
+        if (cache.watches.count(e->wd) == 0)
+            inotify_rm_watch(cache.inotify_fd, e->wd);
+    }
+    cache.bytes -= e->file->body.length();
+    cache.lru.erase(e->lru_pos);
+    cache.entries.erase(e->path);
+    delete e;
+}
+
+// Look up a cached file, moving it to the front of the LRU list
+cache_entry *cacheLookup(file_cache &cache, const string &path) {
+    auto it = cache.entries.find(path);
+    if (it == cache.entries.end())
+        return NULL;
+    cache_entry *e = it->second;
+    // Entries without an inotify watch are checked against the file's mtime
+    if (e->wd < 0) {
+        stat_entry *st = statCached(cache, path);
+        if (st->err != 0 || st->info.st_mtime != e->mtime ||
+                (size_t)st->info.st_size != e->file->body.length()) {
+            cacheRemove(cache, e);
+            return NULL;
+        }
+    }
+    cache.lru.splice(cache.lru.begin(), cache.lru, e->lru_pos);
+    return e;
+}
+
+// Read a small file into the cache, evicting least recently used entries to
+// make room. Returns NULL if the file couldn't be read in full.
+cache_entry *cacheInsert(file_cache &cache, const string &path, int file_fd, const struct stat &fileinfo) {
+    size_t length = fileinfo.st_size;
+    while (!cache.lru.empty() && cache.bytes + length > cache_capacity)
+        cacheRemove(cache, cache.lru.back());
+
+    cached_file *file = new cached_file();
+    file->body.resize(length);
+    size_t got = 0;
+    while (got < length) {
+        ssize_t n = pread(file_fd, &file->body[got], length - got, got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    if (got != length) {
+        delete file;
+        return NULL;
+    }
+    file->etag = fileETag(fileinfo);
+    file->mtime = fileinfo.st_mtime;
+    file->head = buildHeaders(OK_STATUS, parseFileType(path), length) + ACCEPT_RANGES
+                    + validatorHeaders(file->etag, file->mtime);
+
+    cache_entry *e = new cache_entry();
+    e->path = path;
+    e->file = shared_ptr<const cached_file>(file);
+    e->mtime = fileinfo.st_mtime;
+    e->wd = -1;
+    if (cache.inotify_fd >= 0) {
+        e->wd = inotify_add_watch(cache.inotify_fd, path.c_str(),
+                    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (e->wd >= 0)
+            cache.watches.insert(make_pair(e->wd, e));
+    }
+    cache.lru.push_front(e);
+    e->lru_pos = cache.lru.begin();
+    cache.entries[path] = e;
+    cache.bytes += length;
+    return e;
+}
+
+// Evict every entry whose file changed on disk
+void cacheInvalidate(file_cache &cache) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t n = read(cache.inotify_fd, buf, sizeof(buf));
+        if (n <= 0)
+            return;
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            auto range = cache.watches.equal_range(event->wd);
+            vector<cache_entry*> stale;
+            for (auto it = range.first; it != range.second; ++it)
+                stale.push_back(it->second);
+            for (size_t i = 0; i < stale.size(); i++) {
+                // the kernel already dropped the watch for IN_IGNORED
+                if (event->mask & IN_IGNORED)
+                    stale[i]->wd = -1;
+                cache.stats.erase(stale[i]->path);
+                cacheRemove(cache, stale[i]);
+            }
+            if (event->mask & IN_IGNORED)
+                cache.watches.erase(event->wd);
+        }
+    }
+}
+
+void uringCloseFile(uring *ring, int fd);
+
+// Close a file the response no longer needs
+void closeFile(worker *w, int fd) {
+    if (w->ring != NULL)
+        uringCloseFile(w->ring, fd);
+    else
+        close(fd);
+}
+
+// Pick the content coding to send from an Accept-Encoding header: "gzip",
+// "deflate", or NULL to send the file as is. Codings with q=0 are refused,
+// and "*" only stands for the codings the header doesn't name (RFC 9110).
+const char *chooseEncoding(string_view accept) {
+    bool gzip = false, deflate = false, any = false;
+    bool gzip_named = false, deflate_named = false;
+    while (!accept.empty()) {
+        size_t comma = accept.find(',');
+        string_view item = accept.substr(0, comma);
+        string_view name = item.substr(0, item.find(';'));
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t'))
+            name.remove_prefix(1);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t'))
+            name.remove_suffix(1);
+        // q=0, q=0.0 and so on mean "not acceptable"
+        bool refused = false;
+        size_t q = item.find("q=");
+        if (q != string_view::npos) {
+            string_view value = item.substr(q + 2);
+            refused = !value.empty() && value[0] == '0' && value.find_first_of("123456789") == string_view::npos;
+        }
+        if (name.length() == 4 && strncasecmp(name.data(), "gzip", 4) == 0) {
+            gzip_named = true;
+            gzip = gzip || !refused;
+        } else if (name.length() == 7 && strncasecmp(name.data(), "deflate", 7) == 0) {
+            deflate_named = true;
+            deflate = deflate || !refused;
+        } else if (name == "*") {
+            any = any || !refused;
+        }
+        if (comma == string_view::npos)
+            break;
+        accept.remove_prefix(comma + 1);
+    }
+    if (gzip || (any && !gzip_named))
+        return "gzip";
+    if (deflate || (any && !deflate_named))
+        return "deflate";
+    return NULL;
+}
+
+// Only text is worth compressing, everything else is sent as is
+bool isCompressible(const string &file_name) {
+    string type = parseFileType(file_name);
+    return type == HTML || type == TXT;
+}
+
+// Compress data as gzip, or as a zlib stream for "deflate". Returns false
+// if zlib fails.
+bool compressData(const string &data, const char *coding, string &out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // window bits 15 + 16 asks zlib for a gzip wrapper
+    int window = strcmp(coding, "gzip") == 0 ? 15 + 16 : 15;
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, window, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(deflateBound(&zs, data.length()));
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.length();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = out.length();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+// Drop an entry from the compressed-response cache
+void compressedRemove(compressed_cache &cache, compressed_entry *e) {
+    if (e->file)
+        cache.bytes -= e->file->body.length();
+    cache.lru.erase(e->lru_pos);
+    cache.entries.erase(e->key);
+    delete e;
+}
+
+// Read a whole file into data. Returns false if it couldn't be read in full.
+bool readFile(const string &path, size_t length, string &data) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    data.resize(length);
+    size_t got = 0;
+    while (got < length) {
+        ssize_t n = pread(fd, &data[got], length - got, got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    return got == length;
+}
+
+// Return the compressed version of a text file for the given coding,
+// compressing it if the cache has no copy of the current file. Returns NULL
+// if the file should be sent as is. The file is read and compressed on the
+// worker thread, which happens once per version of the file.
+shared_ptr<const cached_file> compressedLookup(worker *w, const string &path, const char *coding) {
+    compressed_cache &cache = w->compressed;
+    if (compressed_capacity == 0)
+        return NULL;
+    stat_entry *st = statCached(w->cache, path);
+    if (st->err != 0 || !S_ISREG(st->info.st_mode) || st->info.st_size > MAX_COMPRESSED_FILE)
+        return NULL;
+    string etag = fileETag(st->info);
+    struct stat fileinfo = st->info;
+
+    string key = path + ':' + coding;
+    auto it = cache.entries.find(key);
+    if (it != cache.entries.end()) {
+        compressed_entry *e = it->second;
+        if (e->source_etag == etag) {
+            counterAdd(cache.hits, 1);
+            cache.lru.splice(cache.lru.begin(), cache.lru, e->lru_pos);
+            return e->file;
+        }
+        compressedRemove(cache, e);
+    }
+    counterAdd(cache.misses, 1);
+
+    // Small files are usually in the file cache already
+    string data;
+    cache_entry *source = cacheLookup(w->cache, path);
+    if (source != NULL && source->file->etag == etag)
+        data = source->file->body;
+    else if (!readFile(path, fileinfo.st_size, data))
+        return NULL;
+
+    compressed_entry *e = new compressed_entry();
+    e->key = key;
+    e->source_etag = etag;
+    string body;
+    if (compressData(data, coding, body) && body.length() < data.length() &&
+            body.length() <= compressed_capacity) {
+        while (!cache.lru.empty() && cache.bytes + body.length() > compressed_capacity)
+            compressedRemove(cache, cache.lru.back());
+        cached_file *file = new cached_file();
+        file->body.swap(body);
+        // the compressed bytes are a different representation, so they get
+        // their own entity tag
+        file->etag = etag.substr(0, etag.length() - 1) + (strcmp(coding, "gzip") == 0 ? "-gz\"" : "-df\"");
+        file->mtime = fileinfo.st_mtime;
+        file->head = buildHeaders(OK_STATUS, parseFileType(path), file->body.length()) + ACCEPT_RANGES
+                        + validatorHeaders(file->etag, file->mtime);
+        e->file = shared_ptr<const cached_file>(file);
+        cache.bytes += file->body.length();
+    }
+    cache.lru.push_front(e);
+    e->lru_pos = cache.lru.begin();
+    cache.entries[key] = e;
+    return e->file;
+}
+
+// Drop the body of a response that turned out not to need one
+void dropBody(connection *c, response &r) {
+    r.cached.reset();
+    if (r.file_fd >= 0) {
+        closeFile(c->w, r.file_fd);
+        r.file_fd = -1;
+    }
+    r.file_left = 0;
+}
+
+// True if the request's If-None-Match or If-Modified-Since shows the client
+// already has this version of the file. If-None-Match wins when both are sent.
+bool notModified(const response &r, const string &etag, time_t mtime) {
+    if (!r.if_none_match.empty())
+        return etagMatches(r.if_none_match, etag);
+    if (!r.if_modified_since.empty()) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(r.if_modified_since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        // dates that don't parse are ignored
+        if (end != NULL && *end == '\0')
+            return mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+// Queue a 304 for a file the client already has. It carries the validators
+// but no body.
+void notModifiedResponse(connection *c, response &r, const string &etag, time_t mtime) {
+    dropBody(c, r);
+    r.parts.clear();
+    r.headers = NOT_MODIFIED_STATUS + SERVER_NAME + validatorHeaders(etag, mtime)
+                    + (r.encoding_headers.empty() ? "" : VARY_ENCODING) + connectionHeaders(r);
+    logDebug(c->w, "Server response: %s\n", r.headers.c_str());
+}
+
+// Turn the response for a file into a 206 or 416 if the request had a Range
+// header that applies. The body is either r.cached or r.file_fd. Returns
+// false if the whole file should be sent as usual.
+bool rangeResponse(connection *c, response &r, const string &file_name, size_t size,
+                   const string &etag, time_t mtime) {
+    if (r.range.empty())
+        return false;
+    // If-Range only lets the range through if the file hasn't changed. An
+    // entity tag must match exactly, weak tags never do.
+    if (!r.if_range.empty()) {
+        if (r.if_range[0] == '"' ? r.if_range != etag : r.if_range != httpDate(mtime))
+            return false;
+    }
+    vector<body_part> parts;
+    int count = parseRanges(r.range, size, parts);
+    if (count < 0)
+        return false;
+
+    char content_range[100];
+    if (count == 0) {
+        // Nothing to send, so the body is dropped
+        dropBody(c, r);
+        sprintf(content_range, "Content-Range: bytes */%zu\r\n", size);
+        r.headers = buildHeaders(RANGE_NOT_SATISFIABLE_STATUS, HTML, PAGE_RANGE_NOT_SATISFIABLE.length())
+                        + content_range + connectionHeaders(r) + PAGE_RANGE_NOT_SATISFIABLE;
+        logDebug(c->w, "Server response: %s\n", r.headers.c_str());
+        return true;
+    }
+
+    string type = parseFileType(file_name);
+    if (count == 1) {
+        sprintf(content_range, "Content-Range: bytes %lld-%lld/%zu\r\n", (long long)parts[0].off,
+                (long long)(parts[0].off + parts[0].len - 1), size);
+        r.headers = buildHeaders(PARTIAL_CONTENT_STATUS, type, parts[0].len) + content_range;
+    } else {
+        // multipart/byteranges: every range gets a boundary and its own
+        // Content-Type and Content-Range, and a closing boundary ends the body
+        size_t length = 0;
+        for (size_t i = 0; i < parts.size(); i++) {
+            sprintf(content_range, "Content-Range: bytes %lld-%lld/%zu\r\n\r\n", (long long)parts[i].off,
+                    (long long)(parts[i].off + parts[i].len - 1), size);
+            parts[i].text = "\r\n--" + rangeBoundary + "\r\n" + type + content_range;
+            length += parts[i].text.length() + parts[i].len;
+        }
+        parts.push_back(body_part{"\r\n--" + rangeBoundary + "--\r\n", 0, 0});
+        length += parts.back().text.length();
+        r.headers = buildHeaders(PARTIAL_CONTENT_STATUS,
+                        "Content-Type: multipart/byteranges; boundary=" + rangeBoundary + "\r\n", length);
+    }
+    r.headers += validatorHeaders(etag, mtime) + r.encoding_headers + connectionHeaders(r);
+    r.parts.swap(parts);
+    r.part = 0;
+    if (r.file_fd >= 0) {
+        r.file_off = r.parts[0].off;
+        r.file_left = r.parts[0].len;
+    }
+    logDebug(c->w, "Server response: %s\n", r.headers.c_str());
+    return true;
+}
+
+// Answer a conditional or Range request for a file: a 304, 206 or 416.
+// Returns false if the whole file should be sent as usual.
+bool conditionalResponse(connection *c, response &r, const string &file_name, size_t size,
+                         const string &etag, time_t mtime) {
+    if (notModified(r, etag, mtime)) {
+        notModifiedResponse(c, r, etag, mtime);
+        return true;
+    }
+    return rangeResponse(c, r, file_name, size, etag, mtime);
+}
+
+// Fill in the response for a file that has been opened and stat'ed
+void fileResponse(connection *c, response &r, const string &file_name, int file_fd, const struct stat &fileinfo) {
+    if (!S_ISREG(fileinfo.st_mode)) {
+        closeFile(c->w, file_fd);
+        page404(r);
+        return;
+    }
+
+    // Small files go into the cache and are served from there
+    if (cache_capacity > 0 && fileinfo.st_size <= MAX_CACHED_FILE) {
+        cache_entry *e = cacheInsert(c->w->cache, file_name, file_fd, fileinfo);
+        if (e != NULL) {
+            closeFile(c->w, file_fd);
+            r.cached = e->file;
+            if (conditionalResponse(c, r, file_name, fileinfo.st_size, e->file->etag, e->file->mtime))
+                return;
+            logDebug(c->w, "Server response: %s%s%s\n", e->file->head.c_str(), r.encoding_headers.c_str(),
+                     connectionHeaders(r).c_str());
+            return;
+        }
+    }
+    r.file_fd = file_fd;
+    r.file_left = fileinfo.st_size;
+    string etag = fileETag(fileinfo);
+    if (conditionalResponse(c, r, file_name, fileinfo.st_size, etag, fileinfo.st_mtime))
+        return;
+
+    // Build complete response headers, the body is sent separately
+    r.headers = buildHeaders(OK_STATUS, parseFileType(file_name), fileinfo.st_size)
+                    + ACCEPT_RANGES + validatorHeaders(etag, fileinfo.st_mtime) + r.encoding_headers
+                    + connectionHeaders(r);
+    logDebug(c->w, "Server response: %s\n", r.headers.c_str());
+}
+
+// Percentile of a latency histogram, as the upper bound of the bucket it
+// falls in
+unsigned long long latencyPercentile(const unsigned long *counts, unsigned long total, double p) {
+    unsigned long seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += counts[b];
+        if (total > 0 && seen >= p * total)
+            return 1ULL << b;
+    }
+    return 0;
+}
+
+// Answer a request for the stats endpoint: every worker's counters added up,
+// as plain text, or as JSON for ?format=json or an Accept header asking for it
+void statsResponse(response &r, const http_request &req) {
+    static const char *phases[NUM_PHASES] = {"parse", "open", "send", "total"};
+    unsigned long status[MAX_STATUS] = {0};
+    unsigned long latency[NUM_PHASES][LATENCY_BUCKETS] = {{0}};
+    unsigned long long latency_sum[NUM_PHASES] = {0};
+    unsigned long long bytes = 0;
+    unsigned long requests = 0, rejected = 0, hits = 0, misses = 0, zhits = 0, zmisses = 0;
+    long active = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        worker *w = workers[i];
+        for (int code = 0; code < MAX_STATUS; code++) {
+            status[code] += w->stats.status[code].load(memory_order_relaxed);
+            requests += w->stats.status[code].load(memory_order_relaxed);
+        }
+        for (int ph = 0; ph < NUM_PHASES; ph++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                latency[ph][b] += w->stats.latency[ph].counts[b].load(memory_order_relaxed);
+            latency_sum[ph] += w->stats.latency[ph].sum_ns.load(memory_order_relaxed);
+        }
+        bytes += w->stats.bytes.load(memory_order_relaxed);
+        active += w->connections.load(memory_order_relaxed);
+        rejected += w->rejected.load(memory_order_relaxed);
+        hits += w->cache.hits.load(memory_order_relaxed);
+        misses += w->cache.misses.load(memory_order_relaxed);
+        zhits += w->compressed.hits.load(memory_order_relaxed);
+        zmisses += w->compressed.misses.load(memory_order_relaxed);
+    }
+
+    size_t q = req.path.find('?');
+    string_view query = q == string_view::npos ? string_view() : req.path.substr(q);
+    bool json = query.find("format=json") != string_view::npos ||
+                getHeader(req, "Accept").find("application/json") != string_view::npos;
+    string body;
+    char line[256];
+    if (json) {
+        snprintf(line, sizeof(line), "{\"connections\":{\"active\":%ld,\"rejected\":%lu},"
+                 "\"requests\":%lu,\"bytes_sent\":%llu,\"status\":{", active, rejected, requests, bytes);
+        body += line;
+        const char *sep = "";
+        for (int code = 0; code < MAX_STATUS; code++) {
+            if (status[code] == 0)
+                continue;
+            snprintf(line, sizeof(line), "%s\"%d\":%lu", sep, code, status[code]);
+            body += line;
+            sep = ",";
+        }
+        snprintf(line, sizeof(line), "},\"cache\":{\"hits\":%lu,\"misses\":%lu,\"hit_ratio\":%.4f},"
+                 "\"compressed_cache\":{\"hits\":%lu,\"misses\":%lu,\"hit_ratio\":%.4f},\"latency_ns\":{",
+                 hits, misses, hits + misses ? (double)hits / (hits + misses) : 0.0,
+                 zhits, zmisses, zhits + zmisses ? (double)zhits / (zhits + zmisses) : 0.0);
+        body += line;
+        for (int ph = 0; ph < NUM_PHASES; ph++) {
+            unsigned long count = 0;
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                count += latency[ph][b];
+            snprintf(line, sizeof(line), "%s\"%s\":{\"count\":%lu,\"sum\":%llu,\"p50\":%llu,\"p90\":%llu,"
+                     "\"p99\":%llu,\"buckets\":[", ph ? "," : "", phases[ph], count, latency_sum[ph],
+                     latencyPercentile(latency[ph], count, 0.5), latencyPercentile(latency[ph], count, 0.9),
+                     latencyPercentile(latency[ph], count, 0.99));
+            body += line;
+            // [upper bound, count] for each bucket that has anything in it
+            sep = "";
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                if (latency[ph][b] == 0)
+                    continue;
+                snprintf(line, sizeof(line), "%s[%llu,%lu]", sep, 1ULL << b, latency[ph][b]);
+                body += line;
+                sep = ",";
+            }
+            body += "]}";
+        }
+        body += "}}\n";
+    } else {
+        snprintf(line, sizeof(line), "connections: %ld open, %lu turned away\nrequests: %lu\nbytes sent: %llu\n",
+                 active, rejected, requests, bytes);
+        body += line;
+        for (int code = 0; code < MAX_STATUS; code++) {
+            if (status[code] == 0)
+                continue;
+            snprintf(line, sizeof(line), "status %d: %lu\n", code, status[code]);
+            body += line;
+        }
+        snprintf(line, sizeof(line), "cache: %lu hits, %lu misses (%.1f%% hit rate)\n"
+                 "compressed cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+                 hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                 zhits, zmisses, zhits + zmisses ? 100.0 * zhits / (zhits + zmisses) : 0.0);
+        body += line;
+        for (int ph = 0; ph < NUM_PHASES; ph++) {
+            unsigned long count = 0;
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+                count += latency[ph][b];
+            snprintf(line, sizeof(line), "latency %s: %lu timed, mean %.1fus, p50 <%.1fus, p90 <%.1fus, p99 <%.1fus\n",
+                     phases[ph], count, count ? latency_sum[ph] / 1000.0 / count : 0.0,
+                     latencyPercentile(latency[ph], count, 0.5) / 1000.0,
+                     latencyPercentile(latency[ph], count, 0.9) / 1000.0,
+                     latencyPercentile(latency[ph], count, 0.99) / 1000.0);
+            body += line;
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                if (latency[ph][b] == 0)
+                    continue;
+                snprintf(line, sizeof(line), "  <%.3fus: %lu\n", (1ULL << b) / 1000.0, latency[ph][b]);
+                body += line;
+            }
+        }
+    }
+    r.headers = buildHeaders(OK_STATUS, json ? JSON : TXT, body.length()) + NO_STORE
+                    + connectionHeaders(r) + body;
+    r.file_left = 0;
+}
+
+// Build the response for one parsed client request and queue it for the
+// event loop to send back
+void parseRequest(connection *c, const http_request &req, parse_result result) {
+    logDebug(c->w, "> client request: \n%.*s\n", (int)req.raw.length(), req.raw.data());
+
+    response r;
+    r.started = nowNs();
+    r.written = 0;
+    r.open_started = 0;
+    r.send_started = 0;
+    if (log_level >= 1)
+        r.request_line = string(req.raw.substr(0, req.raw.find_first_of("\r\n")));
+    r.sent = 0;
+    r.file_fd = -1;
+    r.file_off = 0;
+    r.file_left = 0;
+    r.opening = false;
+    r.part = 0;
+    c->requests++;
+
+    // Malformed requests get an error page and the connection is closed,
+    // since we can't tell where the next request would start
+    if (result != PARSE_OK) {
+        r.close_after = true;
+        c->closing = true;
+        if (result == PARSE_TOO_LARGE)
+            errorPage(r, HEADERS_TOO_LARGE_STATUS, PAGE_HEADERS_TOO_LARGE);
+        else if (result == PARSE_NOT_IMPLEMENTED)
+            errorPage(r, NOT_IMPLEMENTED_STATUS, PAGE_NOT_IMPLEMENTED);
+        else
+            errorPage(r, BAD_REQUEST_STATUS, PAGE_BAD_REQUEST);
+        c->responses.push_back(r);
+        return;
+    }
+
+    // Request bodies aren't supported, so stop reading after one
+    bool has_body = !getHeader(req, "Transfer-Encoding").empty() ||
+                    (!getHeader(req, "Content-Length").empty() && getHeader(req, "Content-Length") != "0");
+    r.close_after = !wantsKeepAlive(req) || has_body || c->requests >= max_requests;
+    if (r.close_after)
+        c->closing = true;
+
+    // The server's own counters live at a reserved path
+    string_view path = req.path.substr(0, req.path.find('?'));
+    if (path == STATS_PATH) {
+        statsResponse(r, req);
+        c->responses.push_back(r);
+        return;
     }
-    printf("> client request: \n%s\n", buffer);
 
     // Parse request to retrieve file name
-    string file_name = parseFileName(buffer);
+    string file_name;
+    if (!parseFileName(req.path, file_name)) {
+        errorPage(r, BAD_REQUEST_STATUS, PAGE_BAD_REQUEST);
+        c->responses.push_back(r);
+        return;
+    }
     if (file_name == "") {
-        page404(client_fd);
+        page404(r);
+        c->responses.push_back(r);
         return;
-    } 
-    printf("> file name requested: %s\n\n", file_name.c_str());
+    }
+    logDebug(c->w, "> file name requested: %s\n\n", file_name.c_str());
+    r.range = string(getHeader(req, "Range"));
+    r.if_range = string(getHeader(req, "If-Range"));
+    r.if_none_match = string(getHeader(req, "If-None-Match"));
+    r.if_modified_since = string(getHeader(req, "If-Modified-Since"));
 
-    // Get file descriptor for requested file if it exists and 
-    // Check for valid file descriptor
-    struct stat fileinfo;
-    int file_fd = open(file_name.c_str(), O_RDONLY);
-    if (file_fd < 0) {
-        page404(client_fd);
+    // Text is sent compressed when the client accepts it: from a
+    // precompressed file.gz next to the file if there is one, otherwise
+    // compressed here once and kept in the compressed-response cache
+    file_cache &cache = c->w->cache;
+    const char *coding = chooseEncoding(getHeader(req, "Accept-Encoding"));
+    bool compressible = isCompressible(file_name);
+    if (coding != NULL && strcmp(coding, "gzip") == 0) {
+        stat_entry *gz = statCached(cache, file_name + ".gz");
+        if (gz->err == 0 && S_ISREG(gz->info.st_mode)) {
+            r.encoding_headers = GZIP_ENCODING + VARY_ENCODING;
+            file_name += ".gz";
+            compressible = false;
+        }
+    }
+    if (compressible) {
+        r.encoding_headers = VARY_ENCODING;
+        shared_ptr<const cached_file> z;
+        if (coding != NULL)
+            z = compressedLookup(c->w, file_name, coding);
+        if (z) {
+            r.encoding_headers = (strcmp(coding, "gzip") == 0 ? GZIP_ENCODING : DEFLATE_ENCODING) + VARY_ENCODING;
+            r.cached = z;
+            conditionalResponse(c, r, file_name, z->body.length(), z->etag, z->mtime);
+            c->responses.push_back(r);
+            return;
+        }
+    }
+
+    // Hot files are answered straight from memory
+    cache_entry *e = cacheLookup(cache, file_name);
+    if (e != NULL) {
+        counterAdd(cache.hits, 1);
+        r.cached = e->file;
+        conditionalResponse(c, r, file_name, e->file->body.length(), e->file->etag, e->file->mtime);
+        c->responses.push_back(r);
+        return;
+    }
+    counterAdd(cache.misses, 1);
+
+    // A recent stat() result is enough to answer a revalidation or a missing
+    // file without touching the filesystem
+    stat_entry *st = statPeek(cache, file_name);
+    if (st != NULL && st->err == 0 && S_ISREG(st->info.st_mode)) {
+        string etag = fileETag(st->info);
+        if (notModified(r, etag, st->info.st_mtime)) {
+            notModifiedResponse(c, r, etag, st->info.st_mtime);
+            c->responses.push_back(r);
+            return;
+        }
+    } else if (st != NULL && st->err != 0) {
+        page404(r);
+        c->responses.push_back(r);
+        return;
+    }
+
+    // The io_uring backend opens and stats the file asynchronously
+    if (c->w->ring != NULL) {
+        r.opening = true;
+        r.path = file_name;
+        c->responses.push_back(r);
         return;
-    } if (fstat(file_fd, &fileinfo) < 0) {
-        showError("bad file");
+    }
+
+    // Get file descriptor for requested file if it exists and
+    // Check for valid file descriptor. The fd is kept open and the body is
+    // sent straight from it, so the file is never copied into user space.
+    // The file's info comes from the stat cache while it is fresh.
+    r.open_started = nowNs();
+    st = statCached(cache, file_name);
+    int file_fd = st->err == 0 ? open(file_name.c_str(), O_RDONLY) : -1;
+    latencyAdd(c->w, PHASE_OPEN, nowNs() - r.open_started);
+    if (file_fd < 0) {
+        page404(r);
+        c->responses.push_back(r);
         return;
     }
-    close(file_fd);
+    fileResponse(c, r, file_name, file_fd, st->info);
+    c->responses.push_back(r);
+}
 
-    // Read data from file and store it in a buffer
-    ifstream requestedFile;
-    char* fileBuf;
-    requestedFile.open(file_name.c_str(), ios::in);
-    if (requestedFile.is_open()){
-        requestedFile.seekg(0, requestedFile.end);
-        int length = requestedFile.tellg();
-        requestedFile.seekg(0, requestedFile.beg);
-        fileBuf = new char[length];
-        requestedFile.read(fileBuf, length);
-        requestedFile.close();
+void uringCloseConnection(connection *c);
+
+// Current tick of the timer wheels
+static inline long long timerNow() {
+    return nowMs() / TIMER_TICK_MS;
+}
+
+// Put a connection's timer in the wheel slot for its expiry tick
+void timerPlace(timer_wheel &wheel, connection *c, list<connection*> &from) {
+    long long delta = c->expires - wheel.tick;
+    // timers that are already due fire on the next tick
+    if (delta <= 0)
+        delta = 1;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1LL << (WHEEL_BITS * (level + 1))))
+        level++;
+    // further off than the wheel reaches, park it as far out as it goes
+    if (delta >= (1LL << (WHEEL_BITS * WHEEL_LEVELS)))
+        delta = (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    long long when = wheel.tick + delta;
+    list<connection*> &slot = wheel.slots[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    slot.splice(slot.end(), from, c->timer_pos);
+    c->timer_list = &slot;
+}
+
+// Take a connection's timer out of the wheel
+void timerCancel(connection *c) {
+    if (c->timer_list != NULL) {
+        c->timer_list->erase(c->timer_pos);
+        c->timer_list = NULL;
+    }
+    c->deadline = DEADLINE_NONE;
+}
+
+// (Re)arm a connection's timer to go off in secs seconds
+void setDeadline(connection *c, deadline_kind kind, int secs) {
+    timer_wheel &wheel = c->w->timers;
+    c->deadline = kind;
+    c->expires = timerNow() + (long long)secs * 1000 / TIMER_TICK_MS;
+    if (c->timer_list == NULL) {
+        list<connection*> fresh;
+        c->timer_pos = fresh.insert(fresh.end(), c);
+        timerPlace(wheel, c, fresh);
     } else {
-        showError("error while opening the requested file");
+        timerPlace(wheel, c, *c->timer_list);
+    }
+}
+
+// Pick the deadline for what the connection is doing now. The write deadline
+// is pushed back whenever the client takes more of a response, but a request
+// that is trickling in keeps the deadline set when its first bytes arrived,
+// so sending headers a byte at a time doesn't hold a connection forever.
+void updateDeadline(connection *c) {
+    if (!c->responses.empty()) {
+        if (c->progress || c->deadline != DEADLINE_WRITE)
+            setDeadline(c, DEADLINE_WRITE, write_timeout);
+    } else if (c->parsed < c->request.length()) {
+        if (c->deadline != DEADLINE_HEADER)
+            setDeadline(c, DEADLINE_HEADER, header_timeout);
+    } else {
+        setDeadline(c, DEADLINE_IDLE, keepalive_timeout);
+    }
+    c->progress = false;
+}
+
+// Close connection with client and free memory
+void closeConnection(connection *c) {
+    if (c->w->ring != NULL) {
+        uringCloseConnection(c);
         return;
     }
+    // closing the fd also removes it from the epoll set
+    close(c->fd);
+    for (size_t i = 0; i < c->responses.size(); i++) {
+        if (c->responses[i].file_fd >= 0)
+            close(c->responses[i].file_fd);
+    }
+    if (c->pipe_fds[0] >= 0) {
+        close(c->pipe_fds[0]);
+        close(c->pipe_fds[1]);
+    }
+    if (c->in_ready)
+        c->w->ready.erase(c->ready_pos);
+    timerCancel(c);
+    counterAdd(c->w->connections, -1);
+    delete c;
+}
 
-    // Create headers for response status, server name, content-type,
-    string responseStatus = OK_STATUS;
-    string server = SERVER_NAME;
-    string closeConnection = CLOSED_CONNECTION;
-    string contentType = parseFileType(file_name);
+// Turn every complete request in the read buffer into a queued response.
+// Malformed requests are answered with an error page rather than dropped.
+// Returns false if the connection should be dropped.
+bool processRequests(connection *c) {
+    while (!c->closing && c->responses.size() < MAX_PIPELINE) {
+        const char *buf = c->request.data() + c->parsed;
+        size_t avail = c->request.length() - c->parsed;
+        size_t len = findRequestEnd(buf, avail, &c->scanned);
+        if (len == 0) {
+            if (avail <= MAX_REQUEST_SIZE)
+                break;
+            // No blank line within the size limit
+            http_request req;
+            req.raw = string_view(buf, 0);
+            parseRequest(c, req, PARSE_TOO_LARGE);
+            break;
+        }
 
-    // header for content-length
-    char len[100]; 
-    long long fileLength = fileinfo.st_size;
-    sprintf(len, "Content-Length: %lld\r\n", fileLength);
-    string contentLen(len);
+        http_request req;
+        long long parse_started = nowNs();
+        parse_result result = (len > MAX_REQUEST_SIZE) ? PARSE_TOO_LARGE
+                                                       : parseHttpRequest(buf, len, req);
+        latencyAdd(c->w, PHASE_PARSE, nowNs() - parse_started);
+        if (result == PARSE_TOO_LARGE)
+            req.raw = string_view(buf, 0);
+        parseRequest(c, req, result);
+        c->parsed += len;
+        c->scanned = 0;
+    }
+
+    // Anything after a request that closes the connection is ignored, and
+    // parsed bytes are dropped once the buffer has been used up
+    if (c->closing || c->parsed == c->request.length()) {
+        c->request.clear();
+        c->parsed = 0;
+        c->scanned = 0;
+    } else if (c->parsed > MAX_REQUEST_SIZE) {
+        c->request.erase(0, c->parsed);
+        c->parsed = 0;
+    }
+    return true;
+}
+
+// Read as much of the request as is available. Returns false if the
+// connection should be dropped.
+bool handleRead(connection *c) {
+    char buffer[MAX_REQUEST_SIZE];
+
+    // Edge triggered, so keep reading until the socket is drained
+    while (true) {
+        ssize_t data_len = read(c->fd, buffer, sizeof(buffer));
+        if (data_len > 0) {
+            c->request.append(buffer, data_len);
+            // Don't let a client queue up unlimited pipelined requests
+            if (c->request.length() > MAX_PIPELINE * MAX_REQUEST_SIZE)
+                return false;
+            continue;
+        }
+        if (data_len == 0) {
+            c->peer_closed = true;
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        perror("failed to read from client");
+        return false;
+    }
+
+    return processRequests(c);
+}
+
+// Move up to max bytes of file data into the socket through a pipe with
+// splice(), for files sendfile() can't handle. Returns bytes moved, 0 on
+// EAGAIN and -1 on error.
+ssize_t spliceBody(connection *c, response &r, size_t max) {
+    if (c->pipe_fds[0] < 0 && pipe2(c->pipe_fds, O_NONBLOCK) < 0)
+        return -1;
+
+    // Top up the pipe from the file, then drain the pipe into the socket
+    if (c->pipe_bytes == 0) {
+        ssize_t in = splice(r.file_fd, &r.file_off, c->pipe_fds[1], NULL,
+                            max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (in <= 0)
+            return (in < 0 && errno == EAGAIN) ? 0 : -1;
+        c->pipe_bytes = in;
+    }
+    ssize_t out = splice(c->pipe_fds[0], NULL, c->fd, NULL, c->pipe_bytes,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (out < 0)
+        return (errno == EAGAIN) ? 0 : -1;
+    c->pipe_bytes -= out;
+    r.file_left -= out;
+    return out;
+}
+
+// Fill iov with the in-memory parts of a response, from the current range
+// on. Returns the number of parts, at most RESPONSE_IOVS.
+int responseParts(const response &r, struct iovec *iov) {
+    int n = 0;
+    if (!r.headers.empty() && r.part == 0) {
+        iov[n].iov_base = (void*)r.headers.data();
+        iov[n++].iov_len = r.headers.length();
+    }
+    if (r.cached && r.parts.empty()) {
+        const string &conn = connectionHeaders(r);
+        iov[n].iov_base = (void*)r.cached->head.data();
+        iov[n++].iov_len = r.cached->head.length();
+        if (!r.encoding_headers.empty()) {
+            iov[n].iov_base = (void*)r.encoding_headers.data();
+            iov[n++].iov_len = r.encoding_headers.length();
+        }
+        iov[n].iov_base = (void*)conn.data();
+        iov[n++].iov_len = conn.length();
+        iov[n].iov_base = (void*)r.cached->body.data();
+        iov[n++].iov_len = r.cached->body.length();
+    } else if (r.cached) {
+        // every range of a cached file is sent straight out of the cache
+        for (size_t i = 0; i < r.parts.size(); i++) {
+            if (!r.parts[i].text.empty()) {
+                iov[n].iov_base = (void*)r.parts[i].text.data();
+                iov[n++].iov_len = r.parts[i].text.length();
+            }
+            if (r.parts[i].len > 0) {
+                iov[n].iov_base = (void*)(r.cached->body.data() + r.parts[i].off);
+                iov[n++].iov_len = r.parts[i].len;
+            }
+        }
+    } else if (r.part < r.parts.size() && !r.parts[r.part].text.empty()) {
+        iov[n].iov_base = (void*)r.parts[r.part].text.data();
+        iov[n++].iov_len = r.parts[r.part].text.length();
+    }
+    return n;
+}
 
-    // Build complete response body
-    string response = responseStatus + server + closeConnection 
-                        + contentType + contentLen + "\r\n";
-    printf("Server response: %s\n\n", response.c_str());
+// True if the response has more ranges of a file to send after this one
+static inline bool hasNextPart(const response &r) {
+    return !r.cached && r.part + 1 < r.parts.size();
+}
+
+// Move on to the next range of a multipart response
+void nextPart(response &r) {
+    r.part++;
+    r.sent = 0;
+    r.file_off = r.parts[r.part].off;
+    r.file_left = r.parts[r.part].len;
+}
+
+// Queue the access log record for a response that has been fully written
+void logAccess(connection *c, const response &r, int status, long long usecs) {
+    if (log_level < 1)
+        return;
+    log_record *rec = logReserve(c->w->log);
+    if (rec == NULL)
+        return;
+    rec->kind = LOG_ACCESS;
+    rec->when = time(NULL);
+    rec->status = status;
+    rec->bytes = r.written;
+    rec->usecs = usecs;
+    memcpy(rec->ip, c->ip, sizeof(rec->ip));
+    rec->len = r.request_line.length() < LOG_TEXT_SIZE ? r.request_line.length() : LOG_TEXT_SIZE;
+    memcpy(rec->text, r.request_line.data(), rec->len);
+    logCommit(c->w->log);
+}
+
+// Count a response that has been fully written in the worker's stats, and
+// log it
+void responseDone(connection *c, const response &r) {
+    // the status code is in the status line, "HTTP/1.1 200 OK"
+    const string &head = r.headers.empty() && r.cached ? r.cached->head : r.headers;
+    int status = head.length() > 9 ? atoi(head.c_str() + 9) : 0;
+    long long now = nowNs();
+    worker_stats &stats = c->w->stats;
+    counterAdd(stats.status[status > 0 && status < MAX_STATUS ? status : 0], 1);
+    counterAdd(stats.bytes, r.written);
+    if (r.send_started != 0)
+        latencyAdd(c->w, PHASE_SEND, now - r.send_started);
+    latencyAdd(c->w, PHASE_TOTAL, now - r.started);
+    logAccess(c, r, status, (now - r.started) / 1000);
+}
+
+// Queue a connection that used up its write budget to be written again
+// after the other connections have had their turn
+void yieldWrite(connection *c) {
+    if (c->in_ready)
+        return;
+    c->ready_pos = c->w->ready.insert(c->w->ready.end(), c);
+    c->in_ready = true;
+}
+
+// Advance an iovec array past bytes that have already been written
+void skipSent(struct iovec *&iov, int &iov_count, size_t sent) {
+    while (iov_count > 0 && sent >= iov[0].iov_len) {
+        sent -= iov[0].iov_len;
+        iov++;
+        iov_count--;
+    }
+    if (iov_count > 0) {
+        iov[0].iov_base = (char*)iov[0].iov_base + sent;
+        iov[0].iov_len -= sent;
+    }
+}
 
-    // Write response back to client
-    write(client_fd, response.c_str(), response.length());
-    write(client_fd, fileBuf, fileLength);
+// Write out as much of the queued responses as the socket will take. Each
+// response moves through WRITE_HEADERS -> WRITE_BODY, then the connection
+// either goes back to READ_REQUEST or on to CLOSE_CONN.
+bool handleWrite(connection *c) {
+    // Large bodies are written a bounded amount at a time so one download
+    // can't hold up every other connection on the worker
+    size_t budget = WRITE_BUDGET;
+    while (!c->responses.empty()) {
+        response &r = c->responses.front();
+        if (r.send_started == 0)
+            r.send_started = nowNs();
+
+        while (c->state == WRITE_HEADERS) {
+            // Headers and a cached file go out together in one writev-style call
+            struct iovec parts[RESPONSE_IOVS];
+            struct iovec *iov = parts;
+            int iov_count = responseParts(r, parts);
+            size_t total = 0;
+            for (int i = 0; i < iov_count; i++)
+                total += iov[i].iov_len;
+            if (r.sent == total) {
+                c->state = WRITE_BODY;
+                break;
+            }
+            if (budget == 0) {
+                yieldWrite(c);
+                return true;
+            }
+            skipSent(iov, iov_count, r.sent);
+
+            // MSG_MORE holds the headers back so they share a segment with
+            // the body or the next pipelined response
+            bool more = r.file_left > 0 || hasNextPart(r) || c->responses.size() > 1;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            if (n > 0) {
+                r.sent += n;
+                r.written += n;
+                c->progress = true;
+                budget -= (size_t)n < budget ? n : budget;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            // Socket buffer is full, wait for EPOLLOUT
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            return false;
+        }
+
+        while (c->state == WRITE_BODY && r.file_left > 0) {
+            if (budget == 0) {
+                yieldWrite(c);
+                return true;
+            }
+            size_t want = r.file_left < SENDFILE_CHUNK ? r.file_left : SENDFILE_CHUNK;
+            if (want > budget)
+                want = budget;
+            ssize_t n;
+            if (c->pipe_fds[0] < 0) {
+                n = sendfile(c->fd, r.file_fd, &r.file_off, want);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    // sendfile() not supported for this file, fall back to splice()
+                    n = spliceBody(c, r, want);
+                } else if (n > 0) {
+                    r.file_left -= n;
+                } else if (n == 0) {
+                    // file shrank underneath us, nothing more to send
+                    return false;
+                }
+            } else {
+                n = spliceBody(c, r, want);
+            }
+            if (n > 0) {
+                r.written += n;
+                c->progress = true;
+                budget -= (size_t)n < budget ? n : budget;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            // Socket buffer is full, wait for EPOLLOUT
+            if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            return false;
+        }
+
+        // Each range of a multipart response goes through both states
+        if (hasNextPart(r)) {
+            nextPart(r);
+            c->state = WRITE_HEADERS;
+            continue;
+        }
+
+        // Response is fully written
+        responseDone(c, r);
+        if (r.file_fd >= 0)
+            close(r.file_fd);
+        bool close_after = r.close_after;
+        c->responses.pop_front();
+        if (close_after) {
+            c->state = CLOSE_CONN;
+            return true;
+        }
+        // Pick up pipelined requests that were waiting for room in the queue
+        if (c->responses.empty() && !processRequests(c))
+            return false;
+        c->state = c->responses.empty() ? READ_REQUEST : WRITE_HEADERS;
+    }
+    return true;
+}
+
+// Set up the state for a freshly accepted client
+connection *newConnection(worker *w, int client_fd, const struct sockaddr_in &client_addr) {
+    connection *c = new connection();
+    c->fd = client_fd;
+    c->state = READ_REQUEST;
+    c->w = w;
+    c->requests = 0;
+    c->parsed = 0;
+    c->scanned = 0;
+    c->peer_closed = false;
+    c->closing = false;
+    c->deadline = DEADLINE_NONE;
+    c->timer_list = NULL;
+    c->progress = false;
+    c->unsent = 0;
+    // the client has header_timeout seconds to send its first request
+    setDeadline(c, DEADLINE_HEADER, header_timeout);
+    counterAdd(w->connections, 1);
+    c->pipe_fds[0] = c->pipe_fds[1] = -1;
+    c->pipe_bytes = 0;
+    c->in_ready = false;
+    c->inflight = 0;
+    c->dead = false;
+    c->recv_armed = false;
+    c->write_busy = false;
+    c->open_submitted = false;
+    c->open_fd = -1;
+    c->recv_buf = NULL;
+    c->chunk = -1;
+    c->heap_chunk = NULL;
+    c->chunk_len = c->chunk_sent = 0;
+    inet_ntop(AF_INET, &client_addr.sin_addr, c->ip, sizeof(c->ip));
+    logDebug(w, "> got connection from %s\n\n", c->ip);
+    return c;
+}
+
+// True if the worker already has its share of max_connections open. Each
+// worker gets an equal share so the limit needs no shared counter.
+bool overloaded(worker *w) {
+    return w->connections >= (max_connections + num_workers - 1) / num_workers;
+}
 
-    // Close connection with client and free memory
+// Turn a client away with a 503 and close the connection. The response is
+// small enough to go out with one send() into the empty socket buffer.
+void rejectConnection(worker *w, int client_fd) {
+    counterAdd(w->rejected, 1);
+    send(client_fd, serviceUnavailable.data(), serviceUnavailable.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
     close(client_fd);
-    delete[] fileBuf;
 }
 
-int main () {
-    int client_fd;
-    
+// Accept every pending connection on the worker's listening socket
+void acceptConnections(worker *w) {
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        /*Extract the first connection on the queue of pending connections, create a new socket
+        with the same socket type protocol and address family as the specified socket, and allocate
+        a new file descriptor for that socket.*/
+        int client_fd = accept4(w->listen_fd, (struct sockaddr*)&client_addr, &addr_len, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("failed to extract connection");
+            return;
+        }
+
+        // Past the connection limit the client gets a 503 and is closed
+        // right away, without ever reading its request
+        if (overloaded(w)) {
+            rejectConnection(w, client_fd);
+            continue;
+        }
+
+        connection *c = newConnection(w, client_fd, client_addr);
+
+        // Register for both directions once, edge triggered
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("failed to add client to epoll");
+            closeConnection(c);
+        }
+    }
+}
+
+// Drive a client connection's state machine after an epoll event
+void handleEvent(connection *c, uint32_t events) {
+    if (events & EPOLLERR) {
+        closeConnection(c);
+        return;
+    }
+    // Keep reading while responses are being written so pipelined
+    // requests are picked up
+    if (!c->peer_closed && !c->closing && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        if (!handleRead(c)) {
+            closeConnection(c);
+            return;
+        }
+    }
+    if (c->state == READ_REQUEST && !c->responses.empty())
+        c->state = WRITE_HEADERS;
+    if (c->state == WRITE_HEADERS || c->state == WRITE_BODY) {
+        if (!handleWrite(c)) {
+            closeConnection(c);
+            return;
+        }
+    }
+    // Nothing left to send to a client that has gone away
+    if (c->state == READ_REQUEST && c->peer_closed)
+        c->state = CLOSE_CONN;
+    if (c->state == CLOSE_CONN)
+        closeConnection(c);
+    else
+        updateDeadline(c);
+}
+
+// Bytes of responses written to the socket that the client hasn't received
+// yet. Not available for io_uring connections, whose fd is a fixed slot.
+int unsentBytes(connection *c) {
+    int n = 0;
+    if (c->w->ring != NULL || ioctl(c->fd, SIOCOUTQ, &n) < 0)
+        return 0;
+    return n;
+}
+
+// Advance the worker's timer wheel to the current tick, closing every
+// connection whose deadline has passed
+void expireTimers(worker *w) {
+    timer_wheel &wheel = w->timers;
+    long long now = timerNow();
+    while (wheel.tick < now) {
+        wheel.tick++;
+        // When a level wraps around, move the next slot of the level above
+        // down to where its timers now belong
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel.tick & ((1LL << (WHEEL_BITS * level)) - 1))
+                break;
+            list<connection*> &slot = wheel.slots[level][(wheel.tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            while (!slot.empty())
+                timerPlace(wheel, slot.front(), slot);
+        }
+        list<connection*> &due = wheel.slots[0][wheel.tick & (WHEEL_SLOTS - 1)];
+        while (!due.empty()) {
+            connection *c = due.front();
+            // a timer parked at the edge of the wheel may not be due yet
+            if (c->expires > wheel.tick) {
+                timerPlace(wheel, c, due);
+                continue;
+            }
+            // A response can be handed to the kernel long before the client
+            // has read it. While the socket buffer keeps draining, that's
+            // covered by the write timeout rather than cut off as idle.
+            if (c->responses.empty() && (c->deadline == DEADLINE_IDLE || c->deadline == DEADLINE_WRITE)) {
+                int unsent = unsentBytes(c);
+                if (unsent > 0 && (c->deadline == DEADLINE_IDLE || unsent < c->unsent)) {
+                    c->unsent = unsent;
+                    setDeadline(c, DEADLINE_WRITE, write_timeout);
+                    continue;
+                }
+            }
+            // A slow or stalled client loses its connection; nothing is sent
+            // since it isn't reading, or hasn't finished its request
+            if (c->deadline != DEADLINE_IDLE)
+                fprintf(stderr, "> closing %s: %s timeout\n", c->ip,
+                        c->deadline == DEADLINE_HEADER ? "header" : "write");
+            closeConnection(c);
+        }
+    }
+}
+
+// Print a worker's cache hit/miss counters
+void printCacheStats(worker *w) {
+    fprintf(stderr, "> worker %d: %d connections open, %lu turned away\n", w->id, w->connections.load(),
+            w->rejected.load());
+    compressed_cache &compressed = w->compressed;
+    fprintf(stderr, "> worker %d compressed cache: %lu hits, %lu misses, %zu entries, %zu bytes\n",
+            w->id, compressed.hits.load(), compressed.misses.load(), compressed.entries.size(), compressed.bytes);
+    file_cache &cache = w->cache;
+    unsigned long hits = cache.hits, misses = cache.misses;
+    fprintf(stderr, "> worker %d cache: %lu hits, %lu misses (%.1f%% hit rate), %zu files, %zu bytes\n",
+            w->id, hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+            cache.entries.size(), cache.bytes);
+}
+
+// SIGUSR1 asks every worker to print its cache counters
+void statsHandler(int s) {
+    (void)s;
+    stats_requested++;
+}
+
+// Create a listening socket on PORT. SO_REUSEPORT lets every worker bind its
+// own socket and the kernel spreads incoming connections between them.
+int createListener() {
+    int fd;
     // Initialize socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
         showError("failed to initialize socket");
     }
-
-    // Setup signal to gracefully close server fd on SIGINT
-    signal (SIGINT, sighandler);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        showError("failed to set SO_REUSEPORT");
+    }
 
     // Setup socket address info
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in server_addr;
     memset((char *)&server_addr, 0, sizeof(server_addr));
 
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(PORT);
     server_addr.sin_addr.s_addr = INADDR_ANY;
     // Bind socket to host and IP
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
+    if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
         showError("failed to bind socket to ip:port_num");
     }
 
     // Wait for another connection request passively
-    if (listen(server_fd, BACKLOG) < 0) {
+    if (listen(fd, backlog) < 0) {
         showError("failed to listen to new socket connections");
     }
+    return fd;
+}
+
+// Housekeeping done every timer tick by every worker
+void periodicTasks(worker *w) {
+    expireTimers(w);
+    if (w->stats_seen != stats_requested) {
+        w->stats_seen = stats_requested;
+        printCacheStats(w);
+    }
+}
+
+// io_uring backend. Accept, recv, openat, statx, send, read and close all go
+// through one ring per worker; completions queue up the next operations,
+// which are then submitted together with a single io_uring_enter() per
+// loop. Client sockets live in a sparse fixed-file table (accepted straight
+// into it), file bodies are streamed through registered buffers, and the
+// ring talks to the kernel without liburing, through the raw syscalls.
 
+// Operation an SQE belongs to, kept in the low bits of its user_data
+enum uring_op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_OPEN,
+    OP_STATX,
+    OP_SEND,
+    OP_READ,
+    OP_WRITE,
+    OP_MISC
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // SQEs filled in since the last io_uring_enter()
+    unsigned pending;
+    // registered buffers and the ones not in use
+    char *chunks;
+    vector<int> free_chunks;
+    // where the single outstanding accept stores the client address
+    struct sockaddr_in accept_addr;
+    socklen_t accept_len;
+    // TIMER_TICK_MS timeout driving periodicTasks() once per timer tick
+    struct __kernel_timespec tick;
+};
+
+static inline uint64_t uringTag(void *p, uring_op op) {
+    return (uint64_t)(uintptr_t)p | op;
+}
+
+// Enter the kernel to submit pending SQEs and optionally wait for a completion
+int uringEnter(uring *ring, unsigned wait) {
     while (true) {
-        /*Extract the first connection on the queue of pending connections, create a new socket 
-        with the same socket type protocol and address family as the specified socket, and allocate 
-        a new file descriptor for that socket.*/
-        if ((client_fd = accept(server_fd, (struct sockaddr*)&client_addr, (socklen_t*)&server_addr)) < 0) {
-            showError("failed to extract connection");
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            ring->pending -= (unsigned)ret < ring->pending ? ret : ring->pending;
+            return ret;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+        if (wait == 0)
+            return 0;
+    }
+}
+
+// Grab the next free SQE, flushing the queue to the kernel if it is full
+struct io_uring_sqe *uringGetSqe(uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        uringEnter(ring, 0);
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+// Close a regular file descriptor from the ring, no completion wanted
+void uringCloseFile(uring *ring, int fd) {
+    struct io_uring_sqe *sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = uringTag(NULL, OP_MISC);
+}
+
+// Map the rings, register the fixed-file table and body buffers, and queue
+// the first accept. Returns false if the kernel doesn't support what we need.
+bool uringInit(worker *w) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = URING_ENTRIES * 4;
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0)
+        return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_CQE_SKIP)) {
+        close(fd);
+        return false;
+    }
+
+    uring *ring = new uring();
+    ring->fd = fd;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *base = (char*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (base == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        delete ring;
+        return false;
+    }
+    ring->sq_head = (unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqes = (struct io_uring_sqe*)sqes;
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    ring->pending = 0;
+
+    // Sparse fixed-file table that accepted sockets are placed into
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_MAX_FILES;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        close(fd);
+        delete ring;
+        return false;
+    }
+
+    // Registered buffers for streaming file bodies; without them bodies go
+    // through per-connection heap buffers
+    ring->chunks = (char*)mmap(NULL, (size_t)URING_CHUNKS * URING_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->chunks != MAP_FAILED) {
+        struct iovec bufs[URING_CHUNKS];
+        for (int i = 0; i < URING_CHUNKS; i++) {
+            bufs[i].iov_base = ring->chunks + (size_t)i * URING_CHUNK_SIZE;
+            bufs[i].iov_len = URING_CHUNK_SIZE;
+        }
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, bufs, URING_CHUNKS) == 0) {
+            for (int i = URING_CHUNKS - 1; i >= 0; i--)
+                ring->free_chunks.push_back(i);
+        }
+    }
+
+    // the timeout fires every timer tick, like epoll_wait() in the epoll loop
+    ring->tick.tv_sec = 0;
+    ring->tick.tv_nsec = TIMER_TICK_MS * 1000000LL;
+    w->ring = ring;
+    return true;
+}
+
+void uringArmAccept(worker *w) {
+    uring *ring = w->ring;
+    ring->accept_len = sizeof(ring->accept_addr);
+    struct io_uring_sqe *sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listen_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->accept_addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&ring->accept_len;
+    // accept straight into a free fixed-file slot
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = uringTag(NULL, OP_ACCEPT);
+}
+
+void uringArmTick(worker *w) {
+    struct io_uring_sqe *sqe = uringGetSqe(w->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&w->ring->tick;
+    sqe->len = 1;
+    sqe->user_data = uringTag(&w->timers, OP_MISC);
+}
+
+void uringArmInotify(worker *w) {
+    if (w->cache.inotify_fd < 0)
+        return;
+    struct io_uring_sqe *sqe = uringGetSqe(w->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->cache.inotify_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uringTag(&w->cache, OP_MISC);
+}
+
+void uringArmRecv(connection *c) {
+    if (c->recv_armed || c->peer_closed || c->closing || c->dead)
+        return;
+    // Leave the socket alone while the pipeline is full
+    if (c->request.length() - c->parsed > MAX_PIPELINE * MAX_REQUEST_SIZE)
+        return;
+    if (c->recv_buf == NULL)
+        c->recv_buf = new char[MAX_REQUEST_SIZE];
+    struct io_uring_sqe *sqe = uringGetSqe(c->w->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)c->recv_buf;
+    sqe->len = MAX_REQUEST_SIZE;
+    sqe->user_data = uringTag(c, OP_RECV);
+    c->recv_armed = true;
+    c->inflight++;
+}
+
+// Free a connection once it is dead and nothing in the ring refers to it
+void uringRelease(connection *c) {
+    if (!c->dead || c->inflight > 0)
+        return;
+    if (c->chunk >= 0)
+        c->w->ring->free_chunks.push_back(c->chunk);
+    delete[] c->recv_buf;
+    delete[] c->heap_chunk;
+    delete c;
+}
+
+void uringCloseConnection(connection *c) {
+    if (c->dead)
+        return;
+    c->dead = true;
+    uring *ring = c->w->ring;
+    timerCancel(c);
+    counterAdd(c->w->connections, -1);
+    for (size_t i = 0; i < c->responses.size(); i++) {
+        if (c->responses[i].file_fd >= 0)
+            uringCloseFile(ring, c->responses[i].file_fd);
+    }
+    c->responses.clear();
+
+    // Shutting the socket down completes any pending recv, then the fixed
+    // slot is closed. The link holds even if the socket is already gone.
+    struct io_uring_sqe *sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->len = SHUT_RDWR;
+    sqe->user_data = uringTag(NULL, OP_MISC);
+    sqe = uringGetSqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = c->fd + 1;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = uringTag(NULL, OP_MISC);
+    uringRelease(c);
+}
+
+// Send the 503 to a client accepted past the connection limit, then close
+// its fixed slot
+void uringRejectConnection(worker *w, int slot) {
+    counterAdd(w->rejected, 1);
+    struct io_uring_sqe *sqe = uringGetSqe(w->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->addr = (uint64_t)(uintptr_t)serviceUnavailable.data();
+    sqe->len = serviceUnavailable.length();
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uringTag(NULL, OP_MISC);
+    sqe = uringGetSqe(w->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = uringTag(NULL, OP_MISC);
+}
+
+// Queue the next write-side operation for the connection's front response:
+// open+statx, headers and cached data, or the next chunk of the file body.
+// Only one of these is in flight per connection at a time.
+void uringPump(connection *c) {
+    uring *ring = c->w->ring;
+    while (!c->dead && !c->write_busy && !c->responses.empty()) {
+        response &r = c->responses.front();
+
+        if (r.opening) {
+            if (c->open_submitted)
+                return;
+            // openat and statx are linked, statx only runs if the open worked
+            struct io_uring_sqe *sqe = uringGetSqe(ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)r.path.c_str();
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = uringTag(c, OP_OPEN);
+            sqe = uringGetSqe(ring);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)r.path.c_str();
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uint64_t)(uintptr_t)&c->stx;
+            sqe->user_data = uringTag(c, OP_STATX);
+            c->open_submitted = true;
+            c->open_fd = -1;
+            c->inflight += 2;
+            r.open_started = nowNs();
+            return;
+        }
+        if (r.send_started == 0)
+            r.send_started = nowNs();
+
+        // Headers and cached data, one sendmsg
+        int iov_count = responseParts(r, c->iov);
+        size_t total = 0;
+        for (int i = 0; i < iov_count; i++)
+            total += c->iov[i].iov_len;
+        if (r.sent < total) {
+            struct iovec *iov = c->iov;
+            skipSent(iov, iov_count, r.sent);
+            memset(&c->msg, 0, sizeof(c->msg));
+            c->msg.msg_iov = iov;
+            c->msg.msg_iovlen = iov_count;
+            bool more = r.file_left > 0 || hasNextPart(r) || c->responses.size() > 1;
+            struct io_uring_sqe *sqe = uringGetSqe(ring);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = c->fd;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+            sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+            sqe->user_data = uringTag(c, OP_SEND);
+            c->write_busy = true;
+            c->inflight++;
+            return;
+        }
+
+        // File body: read a chunk, then write it out
+        if (r.file_left > 0) {
+            if (c->chunk < 0 && c->heap_chunk == NULL) {
+                if (!ring->free_chunks.empty()) {
+                    c->chunk = ring->free_chunks.back();
+                    ring->free_chunks.pop_back();
+                } else {
+                    c->heap_chunk = new char[URING_CHUNK_SIZE];
+                }
+            }
+            char *buf = (c->chunk >= 0) ? ring->chunks + (size_t)c->chunk * URING_CHUNK_SIZE
+                                        : c->heap_chunk;
+            struct io_uring_sqe *sqe = uringGetSqe(ring);
+            if (c->chunk_sent < c->chunk_len) {
+                sqe->opcode = (c->chunk >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                sqe->fd = c->fd;
+                sqe->flags = IOSQE_FIXED_FILE;
+                sqe->addr = (uint64_t)(uintptr_t)(buf + c->chunk_sent);
+                sqe->len = c->chunk_len - c->chunk_sent;
+                sqe->user_data = uringTag(c, OP_WRITE);
+            } else {
+                size_t want = r.file_left < URING_CHUNK_SIZE ? r.file_left : URING_CHUNK_SIZE;
+                sqe->opcode = (c->chunk >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                sqe->fd = r.file_fd;
+                sqe->addr = (uint64_t)(uintptr_t)buf;
+                sqe->len = want;
+                sqe->off = r.file_off;
+                sqe->user_data = uringTag(c, OP_READ);
+            }
+            if (c->chunk >= 0)
+                sqe->buf_index = c->chunk;
+            c->write_busy = true;
+            c->inflight++;
+            return;
+        }
+
+        if (hasNextPart(r)) {
+            nextPart(r);
+            continue;
+        }
+
+        // Response is fully written
+        responseDone(c, r);
+        if (r.file_fd >= 0)
+            uringCloseFile(ring, r.file_fd);
+        bool close_after = r.close_after;
+        c->responses.pop_front();
+        c->chunk_len = c->chunk_sent = 0;
+        if (c->chunk >= 0) {
+            ring->free_chunks.push_back(c->chunk);
+            c->chunk = -1;
+        }
+        if (close_after) {
+            uringCloseConnection(c);
+            return;
+        }
+        // Pick up pipelined requests that were waiting for room in the queue
+        if (c->responses.empty())
+            processRequests(c);
+    }
+
+    if (!c->dead && c->responses.empty()) {
+        if (c->peer_closed) {
+            uringCloseConnection(c);
+        } else {
+            updateDeadline(c);
+            uringArmRecv(c);
+        }
+    }
+}
+
+// Handle one completion
+void uringComplete(worker *w, uint64_t user_data, int res) {
+    uring_op op = (uring_op)(user_data & 7);
+    void *p = (void*)(uintptr_t)(user_data & ~(uint64_t)7);
+
+    if (op == OP_MISC) {
+        if (p == &w->timers) {
+            periodicTasks(w);
+            uringArmTick(w);
+        } else if (p == &w->cache) {
+            cacheInvalidate(w->cache);
+            uringArmInotify(w);
+        }
+        return;
+    }
+    if (op == OP_ACCEPT) {
+        if (res >= 0 && overloaded(w)) {
+            uringRejectConnection(w, res);
+        } else if (res >= 0) {
+            connection *c = newConnection(w, res, w->ring->accept_addr);
+            uringArmRecv(c);
+        } else if (res != -EAGAIN && res != -EINTR) {
+            fprintf(stderr, "failed to extract connection: %s\n", strerror(-res));
+        }
+        uringArmAccept(w);
+        return;
+    }
+
+    connection *c = (connection*)p;
+    c->inflight--;
+    if (c->dead) {
+        if (op == OP_OPEN && res >= 0)
+            uringCloseFile(w->ring, res);
+        uringRelease(c);
+        return;
+    }
+
+    switch (op) {
+        case OP_RECV:
+            c->recv_armed = false;
+            if (res <= 0) {
+                if (res < 0 && res != -ECONNRESET)
+                    fprintf(stderr, "failed to read from client: %s\n", strerror(-res));
+                c->peer_closed = true;
+                if (res < 0 || c->responses.empty()) {
+                    uringCloseConnection(c);
+                    return;
+                }
+                break;
+            }
+            c->request.append(c->recv_buf, res);
+            if (!processRequests(c)) {
+                uringCloseConnection(c);
+                return;
+            }
+            break;
+        case OP_OPEN:
+            c->open_fd = res;
+            return;
+        case OP_STATX: {
+            response &r = c->responses.front();
+            r.opening = false;
+            c->open_submitted = false;
+            latencyAdd(w, PHASE_OPEN, nowNs() - r.open_started);
+            if (res < 0 || c->open_fd < 0) {
+                if (c->open_fd >= 0)
+                    uringCloseFile(w->ring, c->open_fd);
+                page404(r);
+            } else {
+                struct stat fileinfo;
+                memset(&fileinfo, 0, sizeof(fileinfo));
+                fileinfo.st_mode = c->stx.stx_mode;
+                fileinfo.st_size = c->stx.stx_size;
+                fileinfo.st_ino = c->stx.stx_ino;
+                fileinfo.st_mtim.tv_sec = c->stx.stx_mtime.tv_sec;
+                fileinfo.st_mtim.tv_nsec = c->stx.stx_mtime.tv_nsec;
+                statStore(w->cache, r.path, 0, fileinfo);
+                fileResponse(c, r, r.path, c->open_fd, fileinfo);
+            }
+            c->open_fd = -1;
+            break;
+        }
+        case OP_SEND:
+            c->write_busy = false;
+            if (res < 0) {
+                uringCloseConnection(c);
+                return;
+            }
+            c->progress = true;
+            c->responses.front().sent += res;
+            c->responses.front().written += res;
+            break;
+        case OP_READ:
+            c->write_busy = false;
+            // a short file means it shrank underneath us
+            if (res <= 0) {
+                uringCloseConnection(c);
+                return;
+            }
+            c->responses.front().file_off += res;
+            c->chunk_len = res;
+            c->chunk_sent = 0;
+            break;
+        case OP_WRITE:
+            c->write_busy = false;
+            if (res <= 0) {
+                uringCloseConnection(c);
+                return;
+            }
+            c->progress = true;
+            c->chunk_sent += res;
+            c->responses.front().file_left -= res;
+            c->responses.front().written += res;
+            break;
+        default:
+            break;
+    }
+    updateDeadline(c);
+    uringPump(c);
+}
+
+// Event loop for a worker using the io_uring backend
+void runUringWorker(worker *w) {
+    uring *ring = w->ring;
+    uringArmAccept(w);
+    uringArmTick(w);
+    uringArmInotify(w);
+
+    while (true) {
+        // Submit everything queued since the last pass and wait for work
+        if (uringEnter(ring, 1) < 0)
+            showError("io_uring_enter failed");
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            uringComplete(w, user_data, res);
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+// Event loop run by each worker thread
+void runWorker(worker *w) {
+    if (use_uring) {
+        if (uringInit(w)) {
+            runUringWorker(w);
+            return;
+        }
+        fprintf(stderr, "worker %d: io_uring unavailable, falling back to epoll\n", w->id);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        // Wake up every timer tick to expire deadlines, and don't block
+        // while connections are waiting for another turn to write
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, w->ready.empty() ? TIMER_TICK_MS : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            showError("epoll_wait failed");
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                acceptConnections(w);
+            else if (events[i].data.ptr == &w->cache)
+                cacheInvalidate(w->cache);
+            else
+                handleEvent((connection*)events[i].data.ptr, events[i].events);
         }
-        printf("> got connection from %s\n\n", inet_ntoa(client_addr.sin_addr));
-        parseRequest(client_fd);
+        // Give connections that ran out of write budget their next turn
+        list<connection*> ready;
+        ready.swap(w->ready);
+        while (!ready.empty()) {
+            connection *c = ready.front();
+            ready.pop_front();
+            c->in_ready = false;
+            handleEvent(c, EPOLLOUT);
+        }
+        periodicTasks(w);
     }
+}
 
-}
\ No newline at end of file
+int main (int argc, char* argv[]) {
+    // Parse command line options
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:ak:r:T:s:m:c:z:uv:")) != -1) {
+        switch (opt) {
+            case 'b':
+                backlog = atoi(optarg);
+                if (backlog <= 0)
+                    showError("invalid backlog");
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers <= 0)
+                    showError("invalid number of workers");
+                break;
+            case 'a':
+                pin_workers = true;
+                break;
+            case 'k':
+                keepalive_timeout = atoi(optarg);
+                if (keepalive_timeout <= 0)
+                    showError("invalid keep-alive timeout");
+                break;
+            case 'r':
+                max_requests = atoi(optarg);
+                if (max_requests <= 0)
+                    showError("invalid max requests per connection");
+                break;
+            case 'T':
+                header_timeout = atoi(optarg);
+                if (header_timeout <= 0)
+                    showError("invalid header timeout");
+                break;
+            case 's':
+                write_timeout = atoi(optarg);
+                if (write_timeout <= 0)
+                    showError("invalid write timeout");
+                break;
+            case 'm':
+                max_connections = atoi(optarg);
+                if (max_connections <= 0)
+                    showError("invalid max connections");
+                break;
+            case 'c':
+                if (atoi(optarg) < 0)
+                    showError("invalid cache size");
+                cache_capacity = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'z':
+                if (atoi(optarg) < 0)
+                    showError("invalid compressed cache size");
+                compressed_capacity = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'u':
+                use_uring = true;
+                break;
+            case 'v':
+                log_level = atoi(optarg);
+                if (log_level < 0 || log_level > 2)
+                    showError("invalid log level");
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b backlog] [-w workers] [-a] [-k keepalive_secs] [-r max_requests] [-T header_timeout_secs] [-s write_timeout_secs] [-m max_connections] [-c cache_mb] [-z compressed_cache_mb] [-u] [-v log_level]\n", argv[0]);
+                exit(1);
+        }
+    }
+    int num_cores = thread::hardware_concurrency();
+    if (num_cores <= 0)
+        num_cores = 1;
+    if (num_workers == 0)
+        num_workers = num_cores;
+
+    // Setup signal to gracefully close server fd on SIGINT
+    signal (SIGINT, sighandler);
+    // Writing to a client that went away should not kill the server
+    signal (SIGPIPE, SIG_IGN);
+    // Dump cache counters on SIGUSR1
+    signal (SIGUSR1, statsHandler);
+
+    char keep[100];
+    sprintf(keep, "Keep-Alive: timeout=%d, max=%d\r\n", keepalive_timeout, max_requests);
+    closeHeaders = CLOSED_CONNECTION + "\r\n";
+    keepAliveHeaders = KEEP_ALIVE + keep + "\r\n";
+    char boundary[32];
+    sprintf(boundary, "%08lx%08x", (unsigned long)time(NULL), (unsigned)getpid());
+    rangeBoundary = boundary;
+    serviceUnavailable = buildHeaders(SERVICE_UNAVAILABLE_STATUS, HTML, PAGE_SERVICE_UNAVAILABLE.length())
+                            + "Retry-After: 1\r\n" + closeHeaders + PAGE_SERVICE_UNAVAILABLE;
+
+    // Set up every listener before starting any thread so bind errors show up
+    // right away
+    for (int i = 0; i < num_workers; i++) {
+        worker *w = new worker();
+        w->id = i;
+        w->listen_fd = createListener();
+        w->epoll_fd = epoll_create1(0);
+        if (w->epoll_fd < 0) {
+            showError("failed to create epoll instance");
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        // listening socket is the only entry without a connection attached
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) {
+            showError("failed to add server socket to epoll");
+        }
+
+        // Cached files are invalidated through inotify; without it the cache
+        // falls back to comparing st_mtime on every hit
+        w->cache.bytes = 0;
+        w->cache.hits = w->cache.misses = 0;
+        w->compressed.bytes = 0;
+        w->compressed.hits = w->compressed.misses = 0;
+        w->cache.inotify_fd = inotify_init1(IN_NONBLOCK);
+        if (w->cache.inotify_fd >= 0) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = &w->cache;
+            epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->cache.inotify_fd, &ev);
+        }
+        w->timers.tick = timerNow();
+        w->connections = 0;
+        w->rejected = 0;
+        w->stats_seen = 0;
+        w->ring = NULL;
+        w->log = new log_ring();
+        w->log->head = 0;
+        w->log->tail = 0;
+        w->log->dropped = 0;
+        workers.push_back(w);
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        worker *w = workers[i];
+        w->t = thread(runWorker, w);
+        if (pin_workers) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % num_cores, &cpus);
+            if (pthread_setaffinity_np(w->t.native_handle(), sizeof(cpus), &cpus) != 0)
+                fprintf(stderr, "failed to pin worker %d to core %d\n", i, i % num_cores);
+        }
+    }
+    printf("> serving on port %d with %d %s worker(s)\n\n", PORT, num_workers, use_uring ? "io_uring" : "epoll");
+    // the log writer bypasses stdio, so get this out first
+    fflush(stdout);
+    if (log_level > 0)
+        thread(runLogWriter).detach();
+
+    for (int i = 0; i < num_workers; i++)
+        workers[i]->t.join();
+}
@@ -12,7 +12,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
-#include <thread>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <chrono>
 #include <ctime>
 #include <sys/time.h>
@@ -21,6 +24,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <cmath>
+#include <algorithm>
 
 #define EXIT_FAILURE 1
 #define EXIT_SUCCESS 0
@@ -30,23 +34,58 @@
 #define ACK     4
 #define ACK_FIN 5
 #define ACK_SYN 6
+// set on every packet of a connection that uses 64-bit sequence numbers
+#define WIDE    8
 
-// 10 MB
-#define MAX_FILE_SIZE 10*1024*1024
-
-int pack_size          = 524;
 int max_seq_number     = 25600;
 const int payload_size = 512;
-unsigned int seq_num   = 0;
-unsigned int ack_num   = 0;
+uint64_t seq_num       = 0;
+uint64_t ack_num       = 0;
 unsigned int id_num    = 0;
-int time_flag          = 0;
-int window_size        = 10;
+// The server agreed to 64-bit sequence numbers, which never wrap, and the
+// 20-byte header that carries them; otherwise headers are 12 bytes and
+// sequence numbers wrap at max_seq_number
+bool wide              = false;
+const int header_size  = 12;
+const int wide_header_size = 20;
+// Event loop: one epoll instance watching the socket and a timerfd that is
+// armed for the nearest deadline
+int epoll_fd           = -1;
+int timer_fd           = -1;
+// Most segments in flight: the server buffers 20 segments past a gap, and
+// both windows have to fit in the sequence space together. With 64-bit
+// sequence numbers it is the server's window, up to wide_max_window.
+int max_window         = 20;
+const int wide_max_window = 512;
+// Segments sent before the first ACK comes back
+const int initial_window = 4;
+// Congestion control algorithm (-c), reno or cubic
+std::string cc_algorithm = "reno";
+// Bounds on the retransmission timeout in ms (-m, -M), and the timeout used
+// until the first round-trip time has been measured
+double min_rto          = 10;
+double max_rto          = 5000;
+const double initial_rto = 500;
+// CUBIC's scaling constant and multiplicative decrease factor
+const double cubic_c    = 0.4;
+const double cubic_beta = 0.7;
+// The server agreed to ACKs whose payload names the segment they answer;
+// otherwise ACKs are only cumulative and any payload they carry is ignored
+bool sack_permitted    = false;
+// marks the option in the SYN that offers ACK payloads ("RDTO")
+const uint32_t syn_option_magic = 0x5244544f;
+// bits of the option's accepted field the server sets for what it agrees to:
+// ACK payloads, and 64-bit sequence numbers
+const uint16_t option_sack = 1;
+const uint16_t option_wide = 2;
 
-// Header struct for each RDT packet
+// Header struct for each RDT packet, in host byte order. On the wire the
+// sequence and ack numbers are 4 bytes each, followed by the id and flags
+// (12 bytes); packets with the WIDE flag carry the high 4 bytes of the
+// sequence and ack numbers after that (20 bytes).
 struct header {
-    uint32_t seq_num;
-    uint32_t ack_num;
+    uint64_t seq_num;
+    uint64_t ack_num;
     uint16_t id;
     uint16_t flags;
 };
@@ -57,26 +96,284 @@ struct packet {
     char data[payload_size];
 };
 
-// Object in pipelining scheme
+// Payload of a SYN offering ACK payloads (version 1) and 64-bit sequence
+// numbers (version 2). A server that agrees sends it back in the SYN ACK
+// with the accepted bits set and the number of segments it buffers; old
+// servers don't set accepted.
+struct synOption {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t accepted;
+    uint32_t window;
+};
+
+// Object in pipelining scheme: one segment in flight, with its own timer
 struct pipeObj {    
     std::chrono::steady_clock::time_point time_sent;
-    unsigned int seq;
-    unsigned int ack;
-    std::streampos current_pos;
+    uint64_t seq;
+    uint64_t ack;
+    off_t current_pos;
+    // payload bytes, whether the server has acknowledged the segment, and
+    // whether it was sent more than once
+    int len;
+    bool acked;
+    bool resent;
+};
+
+// The file being sent, mapped into memory so segments are sent straight
+// from it, and its length
+struct inputFile {
+    const char *data;
+    off_t len;
 };
 
 typedef struct header header;
 typedef struct packet packet;
 typedef struct pipeObj pipeObj;
+typedef struct inputFile inputFile;
+typedef struct synOption synOption;
 
-// vector for pipelining
+// vector for pipelining, used as a ring of the segments in flight
 std::vector<pipeObj> sendPipe;
 
-void setHeader(packet &p, uint32_t seq, uint32_t ack, uint16_t id, uint16_t flg) {
-    p.pack_header.seq_num = htonl(seq);
-    p.pack_header.ack_num = htonl(ack);
-    p.pack_header.id      = htons(id);
-    p.pack_header.flags   = htons(flg);
+// Round-trip time estimate (Jacobson/Karels) and the retransmission timeout
+// derived from it, all in ms
+struct rttEstimator {
+    double srtt;
+    double rttvar;
+    double rto;
+    bool has_sample;
+};
+typedef struct rttEstimator rttEstimator;
+
+rttEstimator rtt = {0, 0, initial_rto, false};
+
+// Fold a round-trip time measurement into the estimate. Only segments that
+// were sent once are measured (Karn's rule), since an ACK for a resent
+// segment can't be matched to one of its sends.
+void rttSample(double ms) {
+    if (!rtt.has_sample) {
+        rtt.srtt = ms;
+        rtt.rttvar = ms / 2;
+        rtt.has_sample = true;
+    } else {
+        rtt.rttvar = 0.75 * rtt.rttvar + 0.25 * fabs(rtt.srtt - ms);
+        rtt.srtt = 0.875 * rtt.srtt + 0.125 * ms;
+    }
+    // a fresh measurement also undoes any backoff
+    rtt.rto = std::min(std::max(rtt.srtt + 4 * rtt.rttvar, min_rto), max_rto);
+}
+
+// Double the timeout after it ran out, until an ACK brings a new measurement
+void rttBackoff() {
+    rtt.rto = std::min(rtt.rto * 2, max_rto);
+}
+
+// Milliseconds elapsed since a time point
+double elapsedMs(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Congestion control: decides how many segments may be in flight, in
+// segments. The transfer loop only calls these hooks, so another algorithm
+// just has to override them.
+class congestionControl {
+public:
+    double cwnd;
+    double ssthresh;
+
+    congestionControl() : cwnd(initial_window), ssthresh(max_window) {}
+    virtual ~congestionControl() {}
+
+    // Segments that may be in flight right now
+    int window() const {
+        int w = (int)cwnd;
+        return w < 1 ? 1 : (w > max_window ? max_window : w);
+    }
+    // New segments were acknowledged outside of fast recovery
+    virtual void onAck(int acked) = 0;
+    // Third duplicate ACK: the first segment in flight is resent and fast
+    // recovery starts
+    virtual void onFastRetransmit(int in_flight) = 0;
+    // Another duplicate ACK during fast recovery, a segment has left the network
+    virtual void onDupAck() {
+        cwnd += 1;
+    }
+    // Every segment sent before fast recovery started has been acknowledged
+    virtual void onRecovered() {
+        cwnd = ssthresh;
+    }
+    // A segment's retransmission timer ran out: start over from slow start
+    virtual void onTimeout(int in_flight) {
+        ssthresh = std::max(in_flight / 2.0, 2.0);
+        cwnd = 1;
+    }
+};
+
+// Reno: slow start doubles the window every round trip up to ssthresh, then
+// congestion avoidance adds one segment per round trip, and a loss found by
+// duplicate ACKs halves it
+class renoControl : public congestionControl {
+public:
+    void onAck(int acked) {
+        for (int i = 0; i < acked; i++) {
+            if (cwnd < ssthresh)
+                cwnd += 1;
+            else
+                cwnd += 1 / cwnd;
+        }
+    }
+    void onFastRetransmit(int in_flight) {
+        ssthresh = std::max(in_flight / 2.0, 2.0);
+        // the three segments behind the duplicate ACKs have left the network
+        cwnd = ssthresh + 3;
+    }
+};
+
+// CUBIC: after a loss the window follows a cubic curve of the time since
+// then, flattening out around the size it had when the loss happened, so it
+// gets back to that size quickly without depending on the round-trip time
+class cubicControl : public congestionControl {
+public:
+    // window before the last reduction, and when the current curve started
+    // and how long it takes to get back to w_max
+    double w_max;
+    std::chrono::steady_clock::time_point epoch;
+    double k;
+    bool has_epoch;
+
+    cubicControl() : w_max(0), k(0), has_epoch(false) {}
+
+    void onAck(int acked) {
+        for (int i = 0; i < acked; i++) {
+            if (cwnd < ssthresh) {
+                cwnd += 1;
+                continue;
+            }
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            // the curve starts with the first ACK of congestion avoidance
+            if (!has_epoch) {
+                epoch = now;
+                has_epoch = true;
+                if (cwnd < w_max) {
+                    k = cbrt((w_max - cwnd) / cubic_c);
+                } else {
+                    k = 0;
+                    w_max = cwnd;
+                }
+            }
+            double t = std::chrono::duration<double>(now - epoch).count() - k;
+            double target = cubic_c * t * t * t + w_max;
+            // grow toward the curve, but never slower than Reno would
+            double growth = (target - cwnd) / cwnd;
+            double reno = 3 * (1 - cubic_beta) / (1 + cubic_beta) / cwnd;
+            cwnd += std::max(growth, reno);
+        }
+    }
+    void onFastRetransmit(int in_flight) {
+        (void)in_flight;
+        reduce();
+        cwnd = ssthresh + 3;
+    }
+    void onTimeout(int in_flight) {
+        (void)in_flight;
+        reduce();
+        cwnd = 1;
+    }
+
+private:
+    // Multiplicative decrease; the next curve starts once congestion
+    // avoidance resumes
+    void reduce() {
+        // fast convergence: give up bandwidth to newer flows when the window
+        // didn't even get back to where it was
+        w_max = cwnd < w_max ? cwnd * (1 + cubic_beta) / 2 : cwnd;
+        ssthresh = std::max(cwnd * cubic_beta, 2.0);
+        has_epoch = false;
+    }
+};
+
+// Create the congestion control algorithm picked with -c
+congestionControl *newCongestionControl(const std::string &name) {
+    if (name == "reno")
+        return new renoControl();
+    if (name == "cubic")
+        return new cubicControl();
+    return NULL;
+}
+
+// Distance from sequence number b forward to a, in the sequence space
+uint64_t seqDiff(uint64_t a, uint64_t b) {
+    return wide ? a - b : (a + max_seq_number - b) % max_seq_number;
+}
+
+// Sequence number n bytes after a
+uint64_t seqAdd(uint64_t a, uint64_t n) {
+    return wide ? a + n : (a + n) % max_seq_number;
+}
+
+void setHeader(packet &p, uint64_t seq, uint64_t ack, uint16_t id, uint16_t flg) {
+    p.pack_header.seq_num = seq;
+    p.pack_header.ack_num = ack;
+    p.pack_header.id      = id;
+    p.pack_header.flags   = flg;
+}
+
+// Write a header in the connection's format to buf, returns its size
+int encodeHeader(char *buf, const header &h) {
+    uint32_t seq = htonl((uint32_t)h.seq_num);
+    uint32_t ack = htonl((uint32_t)h.ack_num);
+    uint16_t id  = htons(h.id);
+    uint16_t flg = htons(wide ? h.flags | WIDE : h.flags);
+    memcpy(buf, &seq, 4);
+    memcpy(buf + 4, &ack, 4);
+    memcpy(buf + 8, &id, 2);
+    memcpy(buf + 10, &flg, 2);
+    if (!wide)
+        return header_size;
+    seq = htonl((uint32_t)(h.seq_num >> 32));
+    ack = htonl((uint32_t)(h.ack_num >> 32));
+    memcpy(buf + 12, &seq, 4);
+    memcpy(buf + 16, &ack, 4);
+    return wide_header_size;
+}
+
+// Read the header of a datagram of len bytes into h, returns its size or 0
+// if the datagram is too short
+int decodeHeader(const char *buf, int len, header &h) {
+    if (len < header_size)
+        return 0;
+    uint32_t seq, ack;
+    uint16_t id, flg;
+    memcpy(&seq, buf, 4);
+    memcpy(&ack, buf + 4, 4);
+    memcpy(&id, buf + 8, 2);
+    memcpy(&flg, buf + 10, 2);
+    h.seq_num = ntohl(seq);
+    h.ack_num = ntohl(ack);
+    h.id      = ntohs(id);
+    h.flags   = ntohs(flg);
+    if (!(h.flags & WIDE))
+        return header_size;
+    if (len < wide_header_size)
+        return 0;
+    memcpy(&seq, buf + 12, 4);
+    memcpy(&ack, buf + 16, 4);
+    h.seq_num |= (uint64_t)ntohl(seq) << 32;
+    h.ack_num |= (uint64_t)ntohl(ack) << 32;
+    h.flags &= ~WIDE;
+    return wide_header_size;
+}
+
+// Read a sequence number from an ACK's payload, 8 bytes wide or 4
+uint64_t getSeq(const char *buf) {
+    uint32_t half;
+    memcpy(&half, buf, 4);
+    if (!wide)
+        return ntohl(half);
+    uint32_t low;
+    memcpy(&low, buf + 4, 4);
+    return ((uint64_t)ntohl(half) << 32) | ntohl(low);
 }
 
 // Print error 
@@ -94,13 +391,8 @@ void sig_handler(int s){
 }
 
 // Print packet data to stdout
-void printPacketInfo(std::string msg, char f, uint32_t seq, uint32_t ack, uint16_t flg) {
+void printPacketInfo(std::string msg, char f, unsigned long long seq, unsigned long long ack, uint16_t flg) {
     std::string flag = "";
-    if (f == 'S' || f == 'U') {
-        seq = ntohl(seq);
-        ack = ntohl(ack);
-        flg = ntohs(flg);
-    }
     switch(flg) {
         case 0:     flag="";        break;
         case 1:     flag="FIN";     break;
@@ -110,54 +402,124 @@ void printPacketInfo(std::string msg, char f, uint32_t seq, uint32_t ack, uint16
         case 6:     flag="SYN ACK"; break;
     }
     if (msg=="RECV")
-        printf("RECV %u %u %s\n", seq, ack, flag.c_str());
+        printf("RECV %llu %llu %s\n", seq, ack, flag.c_str());
     else if (msg=="SEND") {
         if (f == 'S')
-            printf("SEND %u %u %s\n", seq, ack, flag.c_str());
+            printf("SEND %llu %llu %s\n", seq, ack, flag.c_str());
         else if (f == 'U'){
             if (flag == "") 
-                printf("SEND %u %u DUP-ACK\n", seq, ack);
+                printf("SEND %llu %llu DUP-ACK\n", seq, ack);
             else
-                printf("SEND %u %u %s DUP-ACK\n", seq, ack, flag.c_str());
+                printf("SEND %llu %llu %s DUP-ACK\n", seq, ack, flag.c_str());
         }
     } 
     else if (msg=="RESEND")
-        printf("RESEND %u %u %s\n", seq, ack, flag.c_str());
+        printf("RESEND %llu %llu %s\n", seq, ack, flag.c_str());
     else if (msg=="TIMEOUT")
-        printf("TIMEOUT %u\n", seq);
+        printf("TIMEOUT %llu\n", seq);
+}
+
+// Time point ms milliseconds after another
+std::chrono::steady_clock::time_point addMs(std::chrono::steady_clock::time_point t, double ms) {
+    return t + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(ms));
+}
+
+// Watch the socket and the timer with one epoll instance
+void setupEventLoop(int socket_fd) {
+    epoll_fd = epoll_create1(0);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epoll_fd < 0 || timer_fd < 0)
+        showError("failed to set up event loop\n");
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = socket_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev) < 0)
+        showError("failed to add socket to epoll\n");
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0)
+        showError("failed to add timer to epoll\n");
 }
 
-// can set time_flag to 1 prematurely if ack is received
-void timer(int t) {
-    // check whether time_flag is set to 1 every ms
-    std::chrono::steady_clock::time_point curr = std::chrono::steady_clock::now();
-    while (time_flag != 1) {
-        if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - curr).count() >= t) {
-            time_flag = 1;
-            break;
+// Sleep until a datagram is waiting or the deadline has passed, without
+// using the CPU. Returns false if the deadline passed with nothing to read.
+bool waitFor(int socket_fd, std::chrono::steady_clock::time_point deadline) {
+    // steady_clock is CLOCK_MONOTONIC, the timer's clock; a deadline that
+    // has already passed fires right away, but 0 would disarm the timer
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec  = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    if (ns <= 0)
+        its.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    struct epoll_event events[2];
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, 2, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            showError("epoll_wait failed\n");
+        bool readable = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == socket_fd) {
+                readable = true;
+            } else {
+                // clear the expiration
+                uint64_t count;
+                if (read(timer_fd, &count, sizeof(count)) < 0) {}
+            }
         }
+        return readable;
     }
 }
 
 // Function headers
-int readPacket(int socket_fd, packet &p, struct addrinfo *rp, uint32_t ack);
-void convertToHostByteOrder(packet &p);
+int readPacket(int socket_fd, packet &p, struct addrinfo *rp, uint64_t ack);
+int recvPacket(int socket_fd, packet &p, struct addrinfo *rp);
+void sendPacket(int socket_fd, struct addrinfo *rp, const packet &p, int len);
 void handshake(int socket_fd, struct addrinfo* rp);
 void end_connection(int socket_fd, struct addrinfo* rp);
-void data_transfer(int socket_fd, struct addrinfo* rp, std::string file_name);
+void data_transfer(int socket_fd, struct addrinfo* rp, std::string file_name, congestionControl *cc);
 
 int main(int argc, char* argv[]) {
     // Detect if trying to write to server which has closed its read end
     signal(SIGPIPE, sig_handler);
 
-    if (argc != 4)
+    // Options come before the positional arguments
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m:M:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cc_algorithm = optarg;
+                break;
+            case 'm':
+                min_rto = atof(optarg);
+                break;
+            case 'M':
+                max_rto = atof(optarg);
+                break;
+            default:
+                showError("usage: ./client [-c reno|cubic] [-m min_rto_ms] [-M max_rto_ms] <hostname> <port> <file>\n");
+        }
+    }
+    if (min_rto <= 0 || max_rto < min_rto)
+        showError("invalid retransmission timeout bounds\n");
+    rtt.rto = std::min(std::max(rtt.rto, min_rto), max_rto);
+    if (argc - optind != 3)
         showError("incorrect arguments passed\n");
+    // congestion window for the data transfer
+    congestionControl *cc = newCongestionControl(cc_algorithm);
+    if (cc == NULL)
+        showError("unknown congestion control algorithm\n");
 
     // Parse command line arguments
-    std::string hostname   = argv[1];
-    std::string port_no    = argv[2];
+    std::string hostname   = argv[optind];
+    std::string port_no    = argv[optind+1];
     int port               = std::stoi(port_no);
-    std::string file_name  = argv[3];
+    std::string file_name  = argv[optind+2];
 
     // Check for valid port number
     if (port <= 0 || port > 65536)
@@ -175,7 +537,7 @@ int main(int argc, char* argv[]) {
     hints.ai_flags    = AI_PASSIVE;
 
     // Get internet address with specified port number to bind and connect socket
-    int s = getaddrinfo(hostname.c_str(), argv[2], &hints, &server_info);
+    int s = getaddrinfo(hostname.c_str(), port_no.c_str(), &hints, &server_info);
     if (s != 0)
         showError("failed to get addrinfo\n");
 
@@ -200,41 +562,53 @@ int main(int argc, char* argv[]) {
     // If we try to perform an incompatible read/write, then the system call will fail
     // and set the error to EAGAIN. 
     fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+    setupEventLoop(socket_fd);
 
     // Perform TCP 3-way handshake
     handshake(socket_fd, rp);
     // Transfer file data
-    data_transfer(socket_fd, rp, file_name);
+    data_transfer(socket_fd, rp, file_name, cc);
+    delete cc;
     // Close connection
     end_connection(socket_fd, rp);
 }
 
-// Function to convert from network order to host byte order
-void convertToHostByteOrder(packet &p) {
-    p.pack_header.seq_num = ntohl(p.pack_header.seq_num);
-    p.pack_header.ack_num = ntohl(p.pack_header.ack_num);
-    p.pack_header.id      = ntohs(p.pack_header.id);
-    p.pack_header.flags   = ntohs(p.pack_header.flags);
+// Receive a datagram if one is waiting: its header in host byte order and
+// its payload go to p. Returns the payload's length, or -1 if there was
+// nothing (or nothing valid) to read.
+int recvPacket(int socket_fd, packet &p, struct addrinfo *rp) {
+    char buf[wide_header_size + payload_size];
+    int recv_bytes = recvfrom(socket_fd, buf, sizeof(buf), 0, rp->ai_addr, &rp->ai_addrlen);
+    if (recv_bytes < 0)
+        return -1;
+    int hdr_len = decodeHeader(buf, recv_bytes, p.pack_header);
+    if (hdr_len == 0)
+        return -1;
+    memcpy(p.data, buf + hdr_len, recv_bytes - hdr_len);
+    return recv_bytes - hdr_len;
+}
+
+// Send p's header in the connection's format with len bytes of its payload
+void sendPacket(int socket_fd, struct addrinfo *rp, const packet &p, int len) {
+    char buf[wide_header_size + payload_size];
+    int hdr_len = encodeHeader(buf, p.pack_header);
+    memcpy(buf + hdr_len, p.data, len);
+    sendto(socket_fd, buf, hdr_len + len, 0, rp->ai_addr, rp->ai_addrlen);
 }
 
 // data receiving in stop and wait
-int readPacket(int socket_fd, packet &p, struct addrinfo *rp, uint32_t ack) {
-    memset(&p, 0, pack_size);
-    time_flag = 0;
-    // start timer for 0.5s
-    std::thread timer_thread(timer, 500);
-
-    while (time_flag == 0) {
-        int recv_bytes = recvfrom(socket_fd, &p, pack_size, 0, rp->ai_addr, &rp->ai_addrlen);
+int readPacket(int socket_fd, packet &p, struct addrinfo *rp, uint64_t ack) {
+    memset(&p, 0, sizeof(p));
+    // wait for one retransmission timeout
+    std::chrono::steady_clock::time_point deadline = addMs(std::chrono::steady_clock::now(), rtt.rto);
+
+    while (true) {
+        int recv_bytes = recvPacket(socket_fd, p, rp);
         if (recv_bytes >= 0) {
-            // convert packet to host byte order
-            convertToHostByteOrder(p);
             // print received packet to stdout
             printPacketInfo("RECV", ' ', p.pack_header.seq_num, p.pack_header.ack_num, p.pack_header.flags);
             // expected ack is received correctly
             if (ack == p.pack_header.ack_num || p.pack_header.flags == FIN) {
-                time_flag = 1;
-                timer_thread.join();
                 // return number of bytes received
                 return recv_bytes;
             } 
@@ -242,11 +616,10 @@ int readPacket(int socket_fd, packet &p, struct addrinfo *rp, uint32_t ack) {
             else
                 continue;
         }
+        // packet was not received from sever in time, so need to retransmit
+        if (!waitFor(socket_fd, deadline))
+            return -1;
     }
-
-    // packet was not received from sever within 0.5s, so need to retransmit
-    timer_thread.join();
-    return -1;
 }
 
 // TCP handshake 
@@ -263,9 +636,17 @@ void handshake(int socket_fd, struct addrinfo* rp) {
     srand(time(NULL)+getpid());
     seq_num = rand() % max_seq_number;
     setHeader(send_p, seq_num, ack_num, id_num, SYN);
+    // offer ACK payloads and 64-bit sequence numbers
+    synOption offer;
+    offer.magic    = htonl(syn_option_magic);
+    offer.version  = htons(2);
+    offer.accepted = htons(0);
+    offer.window   = htonl(wide_max_window);
+    memcpy(send_p.data, &offer, sizeof(offer));
 
     // start timer
     start_time = std::chrono::steady_clock::now();
+    bool syn_resent = false;
 
     while (true) {
         // If more than 10 seconds pass, then stop trying to get a response from the server
@@ -274,12 +655,17 @@ void handshake(int socket_fd, struct addrinfo* rp) {
             showError("server has not responded for 10s\n");
         }
         // Send SYN packet
-        sendto(socket_fd, &send_p, pack_size, 0, rp->ai_addr, rp->ai_addrlen);
+        sendPacket(socket_fd, rp, send_p, payload_size);
         printPacketInfo("SEND", 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
+        std::chrono::steady_clock::time_point syn_sent = std::chrono::steady_clock::now();
         // Parse any data packets received
         int recv_bytes = readPacket(socket_fd, receive_p, rp, seq_num+1);
         // If > 0, then server responded correctly and within time
         if (recv_bytes >= 0) {
+            // the SYN ACK is the first round-trip time measurement, unless the
+            // SYN had to be sent again
+            if (!syn_resent)
+                rttSample(elapsedMs(syn_sent));
             // reset timer since message was received from server
             start_time = std::chrono::steady_clock::now();
             // server will set flag to ACK_SYN on first response
@@ -288,81 +674,260 @@ void handshake(int socket_fd, struct addrinfo* rp) {
                 seq_num = receive_p.pack_header.ack_num;
                 ack_num = receive_p.pack_header.seq_num + 1;
                 id_num  = receive_p.pack_header.id;
+                // a server that accepted the offer sends it back with
+                // accepted set; an old one sends a bare header or our own
+                // SYN payload
+                synOption answer;
+                if (recv_bytes >= (int)sizeof(answer)) {
+                    memcpy(&answer, receive_p.data, sizeof(answer));
+                    uint16_t accepted = ntohs(answer.accepted);
+                    if (ntohl(answer.magic) == syn_option_magic && ntohl(answer.window) > 0) {
+                        if (accepted & option_wide) {
+                            wide = true;
+                            max_window = std::min(wide_max_window, (int)ntohl(answer.window));
+                        }
+                        sack_permitted = accepted & option_sack;
+                    }
+                }
                 break;
             }
         } else {
+            syn_resent = true;
+            rttBackoff();
             continue;
         }
     }
 
 }
 
-// Data transfer using sliding window
-void data_transfer(int socket_fd, struct addrinfo* rp, std::string file_name) {
-    // create data packets
-    packet send_p, receive_p;
-    memset(&send_p,    0, sizeof(send_p));
+// Map the file to send into memory, returns false if it can't be read
+bool mapFile(std::string file_name, inputFile &in) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    in.len = st.st_size;
+    in.data = NULL;
+    // an empty file has nothing to map
+    if (in.len > 0) {
+        void *data = mmap(NULL, in.len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        // the file is read front to back, so have the kernel read ahead
+        madvise(data, in.len, MADV_SEQUENTIAL);
+        in.data = (const char *)data;
+    }
+    close(fd);
+    return true;
+}
+
+// Send a segment: the header and the segment's bytes straight from the
+// mapped file
+void sendSegment(int socket_fd, struct addrinfo* rp, const inputFile &in, pipeObj &obj, std::string msg) {
+    packet send_p;
+    obj.len = std::min((off_t)payload_size, in.len - obj.current_pos);
+    setHeader(send_p, obj.seq, obj.ack, id_num, 0);
+    char hdr_buf[wide_header_size];
+    struct iovec iov[2];
+    iov[0].iov_base = hdr_buf;
+    iov[0].iov_len  = encodeHeader(hdr_buf, send_p.pack_header);
+    iov[1].iov_base = (void *)(in.data + obj.current_pos);
+    iov[1].iov_len  = obj.len;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name    = rp->ai_addr;
+    hdr.msg_namelen = rp->ai_addrlen;
+    hdr.msg_iov     = iov;
+    hdr.msg_iovlen  = obj.len > 0 ? 2 : 1;
+    sendmsg(socket_fd, &hdr, 0);
+    printPacketInfo(msg, 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
+    // (re)start the segment's timer
+    obj.time_sent = std::chrono::steady_clock::now();
+    obj.resent = (msg == "RESEND");
+}
+
+// Data transfer using Selective Repeat: every segment in flight has its own
+// timer and only segments whose timer runs out are sent again
+void data_transfer(int socket_fd, struct addrinfo* rp, std::string file_name, congestionControl *cc) {
+    // create data packet for ACKs
+    packet receive_p;
     memset(&receive_p, 0, sizeof(receive_p));
 
-    // open file in binary mode and set output position to the end of the file
-    std::ifstream ifs(file_name.c_str(), std::ios::binary);
-    int file_len = 0;
-
-    // error check
-    if (ifs.good()) {
-        // seek to end of file
-        ifs.seekg(0, ifs.end);
-        // read length
-        file_len = ifs.tellg();
-        // if length > 10MB, close client and report error
-        if (file_len > MAX_FILE_SIZE) {
-            close(socket_fd);
-            showError("transfer file too large\n");
-        }
-        // seek back to the beginning of the file
-        ifs.seekg(0, ifs.beg);
-    } else {
+    // map the file, it can be of any size
+    inputFile in;
+    if (!mapFile(file_name, in))
         showError("error while opening file\n");
-    }
 
     // total number of packets that need to be sent
-    int num_packets = ceil((double)file_len/payload_size);
+    off_t num_packets = (in.len + payload_size - 1) / payload_size;
 
+    // segments in flight start at sendPipe[head]
+    sendPipe.assign(max_window, pipeObj());
+    int head = 0;
     int current = 0;
-    int global_count = 0;
-
-    // when global count == num packets, all data has been transferred
-    while (global_count != num_packets) {
-        // this if condition essentially works like a sliding packet
-        if (current < 10) {
-            // clear EOF bit
-            ifs.clear();
-            // seek to next chunk
-            ifs.seekg(global_count*payload_size);
-            // read data into packet
-            ifs.read(send_p.data, payload_size);
-            // set flag to ACK
-            setHeader(send_p, seq_num, ack_num, id_num, 0);
-            // Send packet
-            sendto(socket_fd, &send_p, ifs.gcount()+12, 0, rp->ai_addr, rp->ai_addrlen);
-            // Display output
-            printPacketInfo("SEND", 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
-            // update ack num by the amount of data read
-            seq_num += ifs.gcount();
-            // incase seq_num overflows, use mod to make sure it stays within bounds
-            seq_num %= max_seq_number;
+    off_t global_count = 0;
+    // time of the last datagram from the server
+    std::chrono::steady_clock::time_point heard = std::chrono::steady_clock::now();
+
+    // state of loss recovery: ACKs in a row that didn't move ack_num,
+    // whether fast recovery is on, and the file position of the first
+    // segment sent after the window was last cut
+    int dup_acks = 0;
+    bool in_recovery = false;
+    off_t recover = 0;
+
+    // when every packet has been sent and acknowledged, all data has been transferred
+    while (global_count != num_packets || current > 0) {
+        // send new segments while the congestion window has room
+        if (current < cc->window() && global_count < num_packets) {
+            pipeObj &obj = sendPipe[(head + current) % max_window];
+            obj.seq = seq_num;
+            obj.ack = ack_num;
+            obj.current_pos = global_count * payload_size;
+            obj.acked = false;
+            sendSegment(socket_fd, rp, in, obj, "SEND");
+            // update seq num by the amount of data read, it wraps around
+            // in the small sequence space
+            seq_num = seqAdd(seq_num, obj.len);
             // increment counters
             current += 1;
             global_count += 1;
             continue;
         }
-        // everytime an ack is received, decrement current by 1 so the window can slide by 1 and the next packet can be sent
-        if (recvfrom(socket_fd, &receive_p, pack_size, 0, rp->ai_addr, &rp->ai_addrlen) > 0){
-            convertToHostByteOrder(receive_p);
+
+        int recv_bytes = recvPacket(socket_fd, receive_p, rp);
+        if (recv_bytes >= 0) {
             printPacketInfo("RECV", ' ', receive_p.pack_header.seq_num, receive_p.pack_header.ack_num, receive_p.pack_header.flags);
-            current -= 1;
+            heard = std::chrono::steady_clock::now();
+            if (receive_p.pack_header.flags == ACK && current > 0) {
+                // ack_num covers every byte before it; anything outside the
+                // bytes in flight is a stale ACK
+                uint64_t base = sendPipe[head].seq;
+                uint64_t acked = seqDiff(receive_p.pack_header.ack_num, base);
+                if (acked > seqDiff(seq_num, base))
+                    acked = 0;
+                // a server that agreed to ACK payloads also names the segment
+                // that triggered the ACK, in a field of 8 bytes with 64-bit
+                // sequence numbers or 4; other servers' payloads mean nothing
+                int field = wide ? 8 : 4;
+                uint64_t sacked = 0;
+                bool has_sack = sack_permitted && recv_bytes >= field;
+                if (has_sack)
+                    sacked = getSeq(receive_p.data);
+                // and after it up to 4 ranges (start, end) past the gap that
+                // it holds, which also cover segments whose own ACK was lost
+                uint64_t block_start[4], block_end[4];
+                int blocks = 0;
+                for (int off = field; has_sack && off + 2 * field <= recv_bytes && blocks < 4; off += 2 * field) {
+                    block_start[blocks] = seqDiff(getSeq(receive_p.data + off), base);
+                    block_end[blocks] = seqDiff(getSeq(receive_p.data + off + field), base);
+                    // ignore ranges that aren't inside the bytes in flight
+                    if (block_start[blocks] < block_end[blocks] && block_end[blocks] <= seqDiff(seq_num, base))
+                        blocks += 1;
+                }
+                // The round trip is timed on the segment the ACK answers: the one
+                // the server names, or without that the last one ack_num covers
+                int newly_acked = 0;
+                pipeObj *timed = NULL;
+                for (int i = 0; i < current; i++) {
+                    pipeObj &obj = sendPipe[(head + i) % max_window];
+                    uint64_t pos = seqDiff(obj.seq, base);
+                    bool in_block = false;
+                    for (int b = 0; b < blocks; b++)
+                        in_block = in_block || (block_start[b] <= pos && pos + obj.len <= block_end[b]);
+                    if (!obj.acked && (pos + obj.len <= acked || (has_sack && obj.seq == sacked) || in_block)) {
+                        obj.acked = true;
+                        newly_acked += 1;
+                        if (!has_sack || obj.seq == sacked)
+                            timed = &obj;
+                    }
+                }
+                if (timed != NULL && !timed->resent)
+                    rttSample(elapsedMs(timed->time_sent));
+                // slide the window past the acknowledged segments at its start
+                while (current > 0 && sendPipe[head].acked) {
+                    head = (head + 1) % max_window;
+                    current -= 1;
+                }
+
+                if (acked > 0) {
+                    dup_acks = 0;
+                    if (!in_recovery) {
+                        cc->onAck(newly_acked);
+                    } else if (current == 0 || sendPipe[head].current_pos >= recover) {
+                        in_recovery = false;
+                        cc->onRecovered();
+                    } else {
+                        // a partial ACK: the next segment before the recovery
+                        // point was lost too, so resend it right away
+                        sendSegment(socket_fd, rp, in, sendPipe[head], "RESEND");
+                    }
+                } else if (has_sack ? newly_acked > 0 : receive_p.pack_header.ack_num == base) {
+                    // a segment after a gap arrived, ack_num didn't move
+                    // (without ACK payloads any ACK for the window's start)
+                    dup_acks += 1;
+                    if (in_recovery) {
+                        cc->onDupAck();
+                    } else if (dup_acks == 3 && sendPipe[head].current_pos >= recover) {
+                        // fast retransmit of the segment the gap starts at
+                        cc->onFastRetransmit(current);
+                        in_recovery = true;
+                        recover = global_count * payload_size;
+                        sendSegment(socket_fd, rp, in, sendPipe[head], "RESEND");
+                    }
+                }
+            }
+        }
+
+        // If more than 10 seconds pass, then stop trying to get a response from the server
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point next = heard + std::chrono::seconds(10);
+        if (now >= next) {
+            close(socket_fd);
+            showError("server has not responded for 10s\n");
         }
+        // resend only the segments whose own timer ran out. A server
+        // without ACK payloads may not keep segments past a gap (the
+        // original one drops them), so there everything after a segment
+        // that timed out is sent again too, as in Go-back-n.
+        bool timed_out = false;
+        double rto = rtt.rto;
+        for (int i = 0; i < current; i++) {
+            pipeObj &obj = sendPipe[(head + i) % max_window];
+            if (obj.acked)
+                continue;
+            if (addMs(obj.time_sent, rto) > now && !(timed_out && !sack_permitted)) {
+                next = std::min(next, addMs(obj.time_sent, rto));
+            } else {
+                // the window starts over from one segment and the timeout
+                // doubles, once per pass
+                if (!timed_out) {
+                    rttBackoff();
+                    cc->onTimeout(current);
+                    in_recovery = false;
+                    dup_acks = 0;
+                    recover = global_count * payload_size;
+                    timed_out = true;
+                }
+                printPacketInfo("TIMEOUT", ' ', obj.seq, 0, 0);
+                sendSegment(socket_fd, rp, in, obj, "RESEND");
+                next = std::min(next, addMs(obj.time_sent, rtt.rto));
+            }
+        }
+
+        // Once the socket is drained and the window is full, sleep until the
+        // next ACK or the nearest segment timer
+        if (recv_bytes < 0 && !(current < cc->window() && global_count < num_packets))
+            waitFor(socket_fd, next);
     }
+    if (in.len > 0)
+        munmap((void *)in.data, in.len);
 }
 
 // Send final messages before closing connection
@@ -385,10 +950,10 @@ void end_connection(int socket_fd, struct addrinfo* rp) {
 
     // start both timers
     start = std::chrono::steady_clock::now(); //10 sec response from server
-    send  = std::chrono::steady_clock::now(); //0.5 sec response from server
+    send  = std::chrono::steady_clock::now(); //one retransmission timeout for a response from server
 
     // Send FIN packet to server
-    sendto(socket_fd, &send_p, pack_size, 0, rp->ai_addr, rp->ai_addrlen);
+    sendPacket(socket_fd, rp, send_p, 0);
     printPacketInfo("SEND", 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
 
     // wait for FIN/ACK
@@ -398,18 +963,18 @@ void end_connection(int socket_fd, struct addrinfo* rp) {
             close(socket_fd);
             showError("FIN ACK not received from server\n");
         }
-        // check 0.5 sec timeout and retransmit FIN packet again incase it was lost
-        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now()-send).count() >= 0.5){
-            sendto(socket_fd, &send_p, pack_size, 0, rp->ai_addr, rp->ai_addrlen);
+        // check retransmission timeout and retransmit FIN packet again incase it was lost
+        if (elapsedMs(send) >= rtt.rto){
+            rttBackoff();
+            sendPacket(socket_fd, rp, send_p, 0);
             printPacketInfo("SEND", 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
             // reset sent packet timer
             send = std::chrono::steady_clock::now();
         }
         // check for datagram from server
-        int recvbytes = recvfrom(socket_fd, &receive_p, pack_size, 0, rp->ai_addr, &rp->ai_addrlen); 
-        if (recvbytes > 0) {
-            // convert to host byte order and print pack to stdout
-            convertToHostByteOrder(receive_p);
+        int recvbytes = recvPacket(socket_fd, receive_p, rp);
+        if (recvbytes >= 0) {
+            // print pack to stdout
             printPacketInfo("RECV", ' ', receive_p.pack_header.seq_num, receive_p.pack_header.ack_num, receive_p.pack_header.flags);
 
             // reset overall timer
@@ -425,7 +990,7 @@ void end_connection(int socket_fd, struct addrinfo* rp) {
                     ack_num = receive_p.pack_header.seq_num + 1;
                     setHeader(send_p, seq_num+1, ack_num, id_num, ACK);
                     // send ACK to server acknowledging FIN
-                    sendto(socket_fd, &send_p, pack_size, 0, rp->ai_addr, rp->ai_addrlen);
+                    sendPacket(socket_fd, rp, send_p, 0);
                     printPacketInfo("SEND", 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
                     // update timer
                     start = std::chrono::steady_clock::now();
@@ -440,8 +1005,7 @@ void end_connection(int socket_fd, struct addrinfo* rp) {
                         return;
                     }
                     // check if we receive any other packet from the server before closing
-                    if (recvfrom(socket_fd, &receive_p, pack_size, 0, rp->ai_addr, &rp->ai_addrlen) > 0){
-                        convertToHostByteOrder(receive_p);
+                    if (recvPacket(socket_fd, receive_p, rp) >= 0){
                         printPacketInfo("RECV", ' ', receive_p.pack_header.seq_num, receive_p.pack_header.ack_num, receive_p.pack_header.flags);
 
                         // drop packet since it was not expected
@@ -449,12 +1013,18 @@ void end_connection(int socket_fd, struct addrinfo* rp) {
                         if (receive_p.pack_header.flags == FIN) {
                             ack_num = receive_p.pack_header.seq_num + 1;
                             setHeader(send_p, seq_num, ack_num, id_num, ACK);
-                            sendto(socket_fd, &send_p, pack_size, 0, rp->ai_addr, rp->ai_addrlen);
+                            sendPacket(socket_fd, rp, send_p, 0);
                             printPacketInfo("SEND", 'S', send_p.pack_header.seq_num, send_p.pack_header.ack_num, send_p.pack_header.flags);
                         }
+                    } else {
+                        waitFor(socket_fd, start + std::chrono::seconds(2));
                     }
                 }
             }
+        } else {
+            // sleep until a datagram arrives, the FIN is due to be resent or
+            // the server is given up on
+            waitFor(socket_fd, std::min(start + std::chrono::seconds(10), addMs(send, rtt.rto)));
         }
     }
 }
\ No newline at end of file
@@ -15,19 +15,66 @@
 #include <stdlib.h>
 #include <fstream>
 #include <map>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <list>
 #include <ctime>
+#include <poll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <netinet/udp.h>
 
 #define FIN     1
 #define SYN     2
 #define ACK     4
 #define ACK_FIN 5
 #define ACK_SYN 6
+// set on every packet of a connection that uses 64-bit sequence numbers
+#define WIDE    8
 
 // connection timeout and packets
-//const unsigned int overall_timeout = 10;
+// seconds without a packet before a connection is dropped, and seconds a
+// finished connection is kept to answer a resent FIN
+const int idle_timeout        = 10;
+const int fin_linger          = 2;
 const int payload_size        = 512;
-const int allowed_connections = 20;
+// connection IDs are 16 bits and 0 means none
+const int allowed_connections = 65535;
 const int max_seq_num         = 25600;
+// segments buffered past a gap; with a sender window no larger than this,
+// both windows fit in the sequence space together
+const int recv_window         = 20;
+// the same for connections with 64-bit sequence numbers, which never wrap
+const int wide_recv_window    = 512;
+// header sizes on the wire, and the largest datagram a client sends
+const int header_size         = 12;
+const int wide_header_size    = 20;
+const int max_packet_size     = wide_header_size + payload_size;
+// marks the option in a SYN that offers ACK payloads and 64-bit sequence
+// numbers ("RDTO")
+const uint32_t syn_option_magic = 0x5244544f;
+// bits of the option's accepted field: ACK payloads, and 64-bit sequence
+// numbers
+const uint16_t option_sack    = 1;
+const uint16_t option_wide    = 2;
+// ranges of buffered segments reported in one ACK
+const int max_sack_blocks     = 4;
+// datagrams taken per recvmmsg() and most replies sent per sendmmsg()
+const int batch_size          = 64;
+// replies to one client the kernel may split out of a single UDP GSO send
+const int gso_max_segments    = 64;
+// receive buffer for datagrams the kernel coalesced with UDP GRO
+const int gro_buffer_size     = 65536;
+// received data is handed to the writer thread in pieces of this size,
+// files that grow past it get disk space reserved this far ahead, and
+// past this much data waiting for the disk new segments are not accepted
+const size_t write_chunk      = 256*1024;
+const off_t preallocate_size  = 4*1024*1024;
+const size_t max_backlog      = 64*1024*1024;
 
 // timeval structs for timers
 struct timeval tv;
@@ -50,10 +97,13 @@ void sighandler(int s) {
     }
 }
 
-// Header struct for each RDT packet
+// Header struct for each RDT packet, in host byte order. On the wire the
+// sequence and ack numbers are 4 bytes each, followed by the id and flags
+// (12 bytes); packets with the WIDE flag carry the high 4 bytes of the
+// sequence and ack numbers after that (20 bytes).
 struct header {
-    uint32_t seq_num;
-    uint32_t ack_num;
+    uint64_t seq_num;
+    uint64_t ack_num;
     uint16_t id;
     uint16_t flags;
 };
@@ -66,32 +116,145 @@ struct packet {
 };
 typedef struct packet packet;
 
+// Payload of a SYN that offers ACK payloads (version 1) and 64-bit sequence
+// numbers (version 2), sent back in the SYN ACK with the accepted bits set
+// and the number of segments the server buffers. Old servers don't set accepted, and their clients get bare
+// cumulative ACKs.
+struct syn_option {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t accepted;
+    uint32_t window;
+};
+typedef struct syn_option syn_option;
+
+// A file being received. It is opened, written and closed by the writer
+// thread, which deletes it after the last write.
+struct disk_file {
+    std::string path;
+    int fd;
+    // bytes written, and the size reserved with fallocate()
+    off_t size;
+    off_t allocated;
+};
+typedef struct disk_file disk_file;
+
+// Data for the writer thread: bytes at an offset of a file, and whether it
+// is the end of the file and should be synced to disk
+struct write_job {
+    disk_file *file;
+    std::vector<char> data;
+    off_t offset;
+    bool last;
+    bool sync;
+};
+typedef struct write_job write_job;
+
+// Each worker has a writer thread, so the packet path never waits for the
+// disk. backlog counts the bytes queued but not written yet.
+struct disk_writer {
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<write_job> jobs;
+    std::atomic<size_t> backlog;
+};
+typedef struct disk_writer disk_writer;
+
 // Connection info struct
 struct conn_info {
     packet pack;
     int isFin;
     struct sockaddr src_addr;
     socklen_t addr_len;
-    std::ofstream file;
-    clock_t t_stamp;
+    // file the data goes to (NULL once it has been closed), data not handed
+    // to the writer yet, and the file offset that data starts at
+    disk_file *file;
+    std::vector<char> pending;
+    off_t pending_offset;
+    // the client offered 64-bit sequence numbers in the SYN option
+    bool wide;
+    // segments that arrived ahead of ack_num: the segment k payloads past
+    // ack_num is kept in slot (window_head + k) % window_slots, and a slot is
+    // empty while its length is 0. The slots are allocated on first use.
+    int window_slots;
+    std::vector<char> window;
+    std::vector<uint16_t> window_len;
+    int window_head;
+    // the client sent the SYN option: ACKs name the segment they answer
+    // and the ranges past a gap that have arrived
+    bool sack;
+    // client's initial sequence number, to recognize a resent SYN
+    uint64_t syn_seq;
+    // key in the address table
+    uint64_t addr_key;
+    // the client acknowledged our FIN, the file is complete
+    bool done;
+    // second of the last packet, and the timer wheel slot the connection is in
+    time_t last_active;
+    int slot;
+    std::list<conn_info*>::iterator wheel_pos;
 };
 typedef struct conn_info conn_info;
 
-// track connections
-conn_info connections[allowed_connections];
-// track timestamp of connections for each connection ID
-std::map<int, time_t> last_t_stamp;
+// Idle connections are found with a timer wheel of one-second slots. A
+// connection waits in the slot of the second it was due to expire when it
+// was placed there, and packets only update last_active; when the slot comes
+// around the connection is either dropped or moved to its new deadline.
+const int wheel_slots = 64;
+struct timer_wheel {
+    std::list<conn_info*> slots[wheel_slots];
+    // last second that has been processed
+    time_t tick;
+};
+typedef struct timer_wheel timer_wheel;
 
-bool isTimeout(clock_t t_stamp, int conn_id) {
-    // CLOCKS_PER_SEC for 32 bit machine ~ 1,000,000 
-    if ( ((clock()-t_stamp)/CLOCKS_PER_SEC > 9) && (conn_id != 0))
-          return true;
-    return false;
+// Each worker thread has its own socket on the port (SO_REUSEPORT), and the
+// kernel sends all datagrams from one client address to the same socket, so
+// the state below is kept per thread and needs no locking.
+// track connections by ID and by the client's address
+thread_local std::unordered_map<uint16_t, conn_info*> connections;
+thread_local std::unordered_map<uint64_t, conn_info*> connections_by_addr;
+// IDs never used start at next_id, up to last_id, and once those run out IDs
+// that are free again are handed out oldest first, so a late packet from a
+// finished connection is unlikely to reach a new one. Every worker has its
+// own range of IDs.
+thread_local std::deque<uint16_t> free_ids;
+thread_local int next_id;
+thread_local int last_id;
+thread_local timer_wheel wheel;
+thread_local disk_writer *writer;
+// log lines waiting to be written at the end of a batch
+thread_local std::string log_lines;
+// connections accepted so far by all workers, used to name the files
+std::atomic<unsigned long> conn_count(0);
+
+// Seconds on a monotonic clock
+time_t nowSecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
 }
 
-void printPacketInfo(std::string msg, packet p) {
+// Key of a client address in the address table
+uint64_t addrKey(const struct sockaddr &addr) {
+    const struct sockaddr_in &in = (const struct sockaddr_in &)addr;
+    return ((uint64_t)in.sin_addr.s_addr << 16) | in.sin_port;
+}
+
+// Seconds a connection may go without packets before it is dropped
+int connTimeout(const conn_info *c) {
+    return c->done ? fin_linger : idle_timeout;
+}
+
+// Put a connection in the wheel slot of its deadline
+void wheelPlace(conn_info *c) {
+    c->slot = (c->last_active + connTimeout(c)) % wheel_slots;
+    c->wheel_pos = wheel.slots[c->slot].insert(wheel.slots[c->slot].end(), c);
+}
+
+void printPacketInfo(std::string msg, const header &h) {
     std::string flag;
-    switch (p.pack_header.flags) {
+    switch (h.flags) {
         case 0:     flag=" ";       break;
         case 1:     flag="FIN";     break;
         case 2:     flag="SYN";     break;
@@ -99,49 +262,620 @@ void printPacketInfo(std::string msg, packet p) {
         case 5:     flag="FIN ACK"; break;
         case 6:     flag="SYN ACK"; break;
     }
-    uint32_t seq_num = p.pack_header.seq_num;
-    uint32_t ack_num = p.pack_header.ack_num;
+    uint64_t seq_num = h.seq_num;
+    uint64_t ack_num = h.ack_num;
     // RECV/SEND/RESEND <seqNum> <AckNum> [SYN] [FIN] [ACK]
     // Resend Scenarios:
     //      Server FIN loss or client FIN-ACK loss
     //      FIN-ACK loss from the client->server
     if (msg=="RECV" || msg=="SEND" || msg=="RESEND")
-        std::cout << msg << " " << seq_num << " " << ack_num << " " << flag << std::endl;
+        log_lines += msg + " " + std::to_string(seq_num) + " " + std::to_string(ack_num) + " " + flag + "\n";
     // Timeout has separate output format
     else if (msg=="TIMEOUT")
-        std::cout << msg << " " << seq_num << std::endl;
+        log_lines += msg + " " + std::to_string(seq_num) + "\n";
 }
 
-// Helper method to update buffer fields
-void updateBuffer(packet &buffer, int i) {
-    buffer.pack_header.seq_num = htonl(connections[i].pack.pack_header.seq_num);
-    buffer.pack_header.ack_num = htonl(connections[i].pack.pack_header.ack_num);
-    buffer.pack_header.id      = htons(connections[i].pack.pack_header.id);
-    buffer.pack_header.flags   = htons(connections[i].pack.pack_header.flags);
+// Write out the logged lines in one go, so lines of different workers
+// don't get mixed up
+void flushLog() {
+    size_t done = 0;
+    while (done < log_lines.length()) {
+        ssize_t n = write(STDOUT_FILENO, log_lines.data() + done, log_lines.length() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    log_lines.clear();
 }
 
-// Set fields to host byte order
-void changeByteOrder(packet &buffer) {
-    buffer.pack_header.seq_num = ntohl(buffer.pack_header.seq_num);
-    buffer.pack_header.ack_num = ntohl(buffer.pack_header.ack_num);
-    buffer.pack_header.id      = ntohs(buffer.pack_header.id);
-    buffer.pack_header.flags   = ntohs(buffer.pack_header.flags);
+// Distance from sequence number b forward to a, in the connection's
+// sequence space
+uint64_t seqDiff(const conn_info *c, uint64_t a, uint64_t b) {
+    return c->wide ? a - b : (a + max_seq_num - b) % max_seq_num;
 }
 
-int main(int argc, char* argv[]) {
-    // Setup signal handler
-    if (signal(SIGINT, sighandler) == SIG_ERR) 
-        showError("could not setup signal handler\n");
+// Sequence number n bytes after a
+uint64_t seqAdd(const conn_info *c, uint64_t a, uint64_t n) {
+    return c->wide ? a + n : (a + n) % max_seq_num;
+}
+
+// Read the header at the start of a datagram of len bytes, returns the
+// header's size on the wire or 0 if the datagram is too short
+int decodeHeader(const char *buf, ssize_t len, header &h) {
+    if (len < header_size)
+        return 0;
+    uint32_t seq, ack;
+    uint16_t id, flags;
+    memcpy(&seq, buf, 4);
+    memcpy(&ack, buf + 4, 4);
+    memcpy(&id, buf + 8, 2);
+    memcpy(&flags, buf + 10, 2);
+    h.seq_num = ntohl(seq);
+    h.ack_num = ntohl(ack);
+    h.id      = ntohs(id);
+    h.flags   = ntohs(flags);
+    if (!(h.flags & WIDE))
+        return header_size;
+    if (len < wide_header_size)
+        return 0;
+    memcpy(&seq, buf + 12, 4);
+    memcpy(&ack, buf + 16, 4);
+    h.seq_num |= (uint64_t)ntohl(seq) << 32;
+    h.ack_num |= (uint64_t)ntohl(ack) << 32;
+    h.flags &= ~WIDE;
+    return wide_header_size;
+}
+
+// Write a header in the 12 or 20-byte format, returns its size
+int encodeHeader(char *buf, const header &h, bool wide) {
+    uint32_t seq = htonl((uint32_t)h.seq_num);
+    uint32_t ack = htonl((uint32_t)h.ack_num);
+    uint16_t id = htons(h.id);
+    uint16_t flags = htons(wide ? h.flags | WIDE : h.flags);
+    memcpy(buf, &seq, 4);
+    memcpy(buf + 4, &ack, 4);
+    memcpy(buf + 8, &id, 2);
+    memcpy(buf + 10, &flags, 2);
+    if (!wide)
+        return header_size;
+    seq = htonl((uint32_t)(h.seq_num >> 32));
+    ack = htonl((uint32_t)(h.ack_num >> 32));
+    memcpy(buf + 12, &seq, 4);
+    memcpy(buf + 16, &ack, 4);
+    return wide_header_size;
+}
+
+// Write a sequence number in network byte order, 8 bytes wide or 4, and
+// return how many bytes that took
+int putSeq(char *buf, uint64_t seq, bool wide) {
+    uint32_t half = htonl((uint32_t)seq);
+    if (!wide) {
+        memcpy(buf, &half, 4);
+        return 4;
+    }
+    uint32_t high = htonl((uint32_t)(seq >> 32));
+    memcpy(buf, &high, 4);
+    memcpy(buf + 4, &half, 4);
+    return 8;
+}
+
+// Replies are collected while a batch of datagrams is handled and sent
+// together afterwards
+struct reply_batch {
+    char packs[batch_size][max_packet_size];
+    int lens[batch_size];
+    struct sockaddr addrs[batch_size];
+    socklen_t addr_lens[batch_size];
+    int count;
+};
+typedef struct reply_batch reply_batch;
+
+thread_local reply_batch replies;
+thread_local int server_fd;
+// the kernel takes UDP_SEGMENT and UDP_GRO on the worker's socket
+thread_local bool use_gso = false;
+thread_local bool use_gro = false;
+
+// Send the queued replies. Runs of equal-sized replies to one client go out
+// as a single GSO message, which the kernel splits into datagrams.
+void flushReplies() {
+    struct mmsghdr msgs[batch_size];
+    struct iovec iovs[batch_size];
+    char cmsgs[batch_size][CMSG_SPACE(sizeof(uint16_t))];
+    int count = 0;
+    for (int i = 0; i < replies.count; ) {
+        int j = i + 1;
+        while (use_gso && j < replies.count && j - i < gso_max_segments
+               && replies.lens[j] == replies.lens[i]
+               && memcmp(&replies.addrs[j], &replies.addrs[i], sizeof(struct sockaddr_in)) == 0)
+            j++;
+        for (int k = i; k < j; k++) {
+            iovs[k].iov_base = &replies.packs[k];
+            iovs[k].iov_len  = replies.lens[k];
+        }
+        struct msghdr &hdr = msgs[count].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name    = &replies.addrs[i];
+        hdr.msg_namelen = replies.addr_lens[i];
+        hdr.msg_iov     = &iovs[i];
+        hdr.msg_iovlen  = j - i;
+        if (j - i > 1) {
+            hdr.msg_control    = cmsgs[count];
+            hdr.msg_controllen = sizeof(cmsgs[count]);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type  = UDP_SEGMENT;
+            cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = replies.lens[i];
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+        count++;
+        i = j;
+    }
+
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(server_fd, msgs + sent, count - sent, 0);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        // Nothing sent but no error either; the clients send again
+        if (n == 0)
+            break;
+        if (errno == EINTR)
+            continue;
+        struct msghdr &hdr = msgs[sent].msg_hdr;
+        // The route can't segment after all; send this run one by one and
+        // leave GSO off from now on
+        if (hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+            use_gso = false;
+            for (size_t k = 0; k < hdr.msg_iovlen; k++)
+                sendto(server_fd, hdr.msg_iov[k].iov_base, hdr.msg_iov[k].iov_len, 0,
+                       (struct sockaddr *)hdr.msg_name, hdr.msg_namelen);
+        }
+        // Otherwise the reply is lost like any datagram and the client
+        // sends again
+        sent++;
+    }
+    replies.count = 0;
+}
+
+// Queue a reply with header h to the client of a connection, in the
+// connection's header format and with len bytes of payload, which the
+// caller writes to the pointer returned
+char *queueReply(conn_info *c, const header &h, int len) {
+    if (replies.count == batch_size)
+        flushReplies();
+    int i = replies.count++;
+    int hdr_len = encodeHeader(replies.packs[i], h, c->wide);
+    replies.lens[i]      = hdr_len + len;
+    replies.addrs[i]     = c->src_addr;
+    replies.addr_lens[i] = c->addr_len;
+    return replies.packs[i] + hdr_len;
+}
+
+// Move ack_num past len bytes that were written in order. The slots stay
+// lined up with the sequence numbers only while every segment is a full
+// payload, so after a short one nothing buffered is kept.
+void slideWindow(conn_info *c, int len) {
+    c->pack.pack_header.ack_num = seqAdd(c, c->pack.pack_header.ack_num, len);
+    c->window_len[c->window_head] = 0;
+    c->window_head = (c->window_head + 1) % c->window_slots;
+    if (len != payload_size)
+        std::fill(c->window_len.begin(), c->window_len.end(), 0);
+}
+
+// Write the start and end sequence numbers of the runs of buffered segments
+// to out, the run holding sequence number latest first and the others in
+// order, and return the bytes written
+int sackBlocks(conn_info *c, uint64_t latest, char *out) {
+    uint64_t starts[max_sack_blocks], ends[max_sack_blocks];
+    int count = 0;
+    uint64_t ack = c->pack.pack_header.ack_num;
+    // slot 0 is the gap at ack_num itself
+    int k = 1;
+    while (k < c->window_slots) {
+        if (c->window_len[(c->window_head + k) % c->window_slots] == 0) {
+            k++;
+            continue;
+        }
+        uint64_t start = seqAdd(c, ack, (uint64_t)k * payload_size);
+        uint64_t len = 0;
+        int slot;
+        while (k < c->window_slots && c->window_len[slot = (c->window_head + k) % c->window_slots] > 0) {
+            len += c->window_len[slot];
+            k++;
+        }
+        bool has_latest = seqDiff(c, latest, start) < len;
+        if (count == max_sack_blocks && !has_latest)
+            continue;
+        if (count == max_sack_blocks)
+            count--;
+        // the newest run goes in front
+        int i = count;
+        if (has_latest) {
+            for (i = count; i > 0; i--) {
+                starts[i] = starts[i - 1];
+                ends[i] = ends[i - 1];
+            }
+        }
+        starts[i] = start;
+        ends[i] = seqAdd(c, start, len);
+        count++;
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        n += putSeq(out + n, starts[i], c->wide);
+        n += putSeq(out + n, ends[i], c->wide);
+    }
+    return n;
+}
+
+// Raise the open file limit as far as allowed, every connection keeps its
+// file open
+void raiseFileLimit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// Write out jobs as they come in, forever
+void runWriter(disk_writer *w) {
+    while (true) {
+        std::unique_lock<std::mutex> guard(w->lock);
+        while (w->jobs.empty())
+            w->ready.wait(guard);
+        write_job job = std::move(w->jobs.front());
+        w->jobs.pop_front();
+        guard.unlock();
+
+        disk_file *f = job.file;
+        if (f->fd < 0) {
+            f->fd = open(f->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (f->fd < 0)
+                fprintf(stderr, "could not open %s: %s\n", f->path.c_str(), strerror(errno));
+        }
+        off_t end = job.offset + job.data.size();
+        if (f->fd >= 0 && !job.data.empty()) {
+            // Reserve space ahead for files that are getting big, so they
+            // are laid out in long runs. The file's size doesn't change, so
+            // nothing reads zeros past the data, and the excess is released
+            // at the end
+            if (job.offset > 0 && end > f->allocated && f->allocated >= 0) {
+                if (fallocate(f->fd, FALLOC_FL_KEEP_SIZE, job.offset, preallocate_size) == 0)
+                    f->allocated = job.offset + preallocate_size;
+                else
+                    f->allocated = -1;
+            }
+            size_t done = 0;
+            while (done < job.data.size()) {
+                ssize_t n = pwrite(f->fd, job.data.data() + done, job.data.size() - done, job.offset + done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    fprintf(stderr, "could not write %s: %s\n", f->path.c_str(), strerror(errno));
+                    break;
+                }
+                done += n;
+            }
+            f->size = std::max(f->size, end);
+        }
+        if (job.last) {
+            if (f->fd >= 0) {
+                // release the space reserved past the end
+                if (f->allocated > f->size && ftruncate(f->fd, f->size) < 0)
+                    fprintf(stderr, "could not truncate %s: %s\n", f->path.c_str(), strerror(errno));
+                if (job.sync)
+                    fsync(f->fd);
+                close(f->fd);
+            }
+            delete f;
+        }
+        w->backlog -= job.data.size();
+    }
+}
+
+// Hand the data a connection has collected to the writer thread, with the
+// end of the file if last is set
+void queueWrite(conn_info *c, bool last, bool sync) {
+    write_job job;
+    job.file   = c->file;
+    job.offset = c->pending_offset;
+    job.last   = last;
+    job.sync   = sync;
+    c->pending_offset += c->pending.size();
+    job.data.swap(c->pending);
+    // a connection that filled one buffer is likely to fill the next
+    if (!last)
+        c->pending.reserve(write_chunk);
+    writer->backlog += job.data.size();
+    std::lock_guard<std::mutex> guard(writer->lock);
+    writer->jobs.push_back(std::move(job));
+    writer->ready.notify_one();
+}
+
+// Add data that arrived in order to the connection's file; it goes to the
+// writer in pieces of exactly write_chunk bytes, so every piece starts at a
+// multiple of write_chunk
+void appendData(conn_info *c, const char *data, int len) {
+    while (len > 0) {
+        int n = std::min(len, (int)(write_chunk - c->pending.size()));
+        c->pending.insert(c->pending.end(), data, data + n);
+        data += n;
+        len -= n;
+        if (c->pending.size() == write_chunk)
+            queueWrite(c, false, false);
+    }
+}
+
+// Finish the connection's file; the writer syncs it to disk if asked to
+void closeFile(conn_info *c, bool sync) {
+    if (c->file == NULL)
+        return;
+    queueWrite(c, true, sync);
+    c->file = NULL;
+}
+
+// Look up the connection a packet belongs to: its ID has to be in use, by
+// the address the packet came from, with the header format it agreed on
+conn_info *findConnection(uint16_t id, const struct sockaddr &addr, bool wide) {
+    std::unordered_map<uint16_t, conn_info*>::iterator it = connections.find(id);
+    if (it == connections.end() || it->second->addr_key != addrKey(addr) || it->second->wide != wide)
+        return NULL;
+    return it->second;
+}
+
+// Drop a connection and make its ID available again
+void freeConnection(conn_info *c) {
+    wheel.slots[c->slot].erase(c->wheel_pos);
+    connections.erase(c->pack.pack_header.id);
+    std::unordered_map<uint64_t, conn_info*>::iterator it = connections_by_addr.find(c->addr_key);
+    if (it != connections_by_addr.end() && it->second == c)
+        connections_by_addr.erase(it);
+    free_ids.push_back(c->pack.pack_header.id);
+    closeFile(c, false);
+    delete c;
+}
+
+// Advance the timer wheel to the current second, dropping connections that
+// have been idle too long and moving the others to their new deadline
+void expireConnections() {
+    time_t now = nowSecs();
+    while (wheel.tick < now) {
+        wheel.tick++;
+        std::list<conn_info*> &slot = wheel.slots[wheel.tick % wheel_slots];
+        std::list<conn_info*>::iterator it = slot.begin();
+        while (it != slot.end()) {
+            conn_info *c = *it++;
+            // deadlines are less than wheel_slots seconds away, so this
+            // never lands in the slot being walked
+            if (c->last_active + connTimeout(c) > wheel.tick) {
+                slot.erase(c->wheel_pos);
+                wheelPlace(c);
+                continue;
+            }
+            if (!c->done)
+                fprintf(stderr, "connection %u timed out\n", c->pack.pack_header.id);
+            freeConnection(c);
+        }
+    }
+}
+
+// Handle SYN flag
+void handleSyn(const header &h, const char *data, int len, const struct sockaddr &client_addr, socklen_t client_addr_len) {
+    // A resent SYN gets the same SYN ACK again
+    conn_info *c = NULL;
+    std::unordered_map<uint64_t, conn_info*>::iterator it = connections_by_addr.find(addrKey(client_addr));
+    if (it != connections_by_addr.end()) {
+        if (it->second->syn_seq == h.seq_num && !it->second->isFin)
+            c = it->second;
+        // otherwise the client started over on the same port
+        else
+            freeConnection(it->second);
+    }
+
+    if (c == NULL) {
+        uint16_t id;
+        if (next_id <= last_id) {
+            id = next_id++;
+        } else if (!free_ids.empty()) {
+            id = free_ids.front();
+            free_ids.pop_front();
+        } else {
+            // every ID is taken, the client will try again
+            return;
+        }
+        c = new conn_info();
+        // Setup correct file path based on connection count
+        std::string file_path = "./" + std::to_string(++conn_count) + ".file";
+
+        // The client may offer ACK payloads (version 1) and 64-bit sequence
+        // numbers (version 2) in the SYN's payload
+        syn_option opt;
+        if (len >= (int)sizeof(opt)) {
+            memcpy(&opt, data, sizeof(opt));
+            c->sack = ntohl(opt.magic) == syn_option_magic && ntohs(opt.version) >= 1;
+            c->wide = c->sack && ntohs(opt.version) >= 2;
+        }
+        c->window_slots = c->wide ? wide_recv_window : recv_window;
+        c->window_len.assign(c->window_slots, 0);
+
+        /* update connection fields */
+        // Set flag to SYN ACK
+        c->pack.pack_header.flags = 6;
+        // New ack number is current seq number + 1
+        c->pack.pack_header.ack_num = h.seq_num + 1;
+        // Initialize random sequence number
+        if (c->wide)
+            c->pack.pack_header.seq_num = ((uint64_t)rand() << 32) | rand();
+        else
+            c->pack.pack_header.seq_num = rand() % max_seq_num;
+        c->pack.pack_header.id = id;
+        c->syn_seq = h.seq_num;
+        c->src_addr = client_addr;
+        c->addr_len = client_addr_len;
+        c->addr_key = addrKey(client_addr);
+        // File to store data in, the writer thread creates it
+        c->file = new disk_file();
+        c->file->path = file_path;
+        c->file->fd = -1;
+        connections[id] = c;
+        connections_by_addr[c->addr_key] = c;
+        c->last_active = nowSecs();
+        wheelPlace(c);
+    }
     
-    // Ensure port number is passed in as argument
-    if (argc != 2)
-        showError("provide port number - ./server <port_no>\n");
+    // send message to client, the SYN ACK is just a header unless it
+    // accepts the client's option //
+    if (c->sack) {
+        syn_option opt;
+        opt.magic    = htonl(syn_option_magic);
+        opt.version  = htons(c->wide ? 2 : 1);
+        opt.accepted = htons(option_sack | (c->wide ? option_wide : 0));
+        opt.window   = htonl(c->window_slots);
+        memcpy(queueReply(c, c->pack.pack_header, sizeof(opt)), &opt, sizeof(opt));
+    } else {
+        queueReply(c, c->pack.pack_header, 0);
+    }
+    printPacketInfo("SEND", c->pack.pack_header);
+}
+
+// Handle ACK flag
+/* Find connection with same ID as in the packet, compare seq_num with ack_num. If they
+are matching, then the packet arrived in order. Send packet back with id, updated ack and 
+seq numbers */
+void handleData(const header &h, const char *data, int len, const struct sockaddr &client_addr, bool wide) {
+    conn_info *c = findConnection(h.id, client_addr, wide);
+    if (c == NULL)
+        return;
+    c->last_active = nowSecs();
+    // If fin flag, then close/save file (already done if the FIN came in
+    // order); the connection lingers a little in case the client's FIN has
+    // to be answered again
+    if (c->isFin) {
+        if (!c->done) {
+            closeFile(c, true);
+            c->done = true;
+            wheel.slots[c->slot].erase(c->wheel_pos);
+            wheelPlace(c);
+        }
+        return;
+    }
+    uint64_t seq_num = h.seq_num;
+    uint64_t offset = seqDiff(c, seq_num, c->pack.pack_header.ack_num);
+    // The disk can't keep up: take nothing new and don't acknowledge it,
+    // the client sends it again later
+    if (len > 0 && writer->backlog > max_backlog)
+        return;
+    // Packet arrived in order
+    if (len > 0 && offset == 0) {
+        //write data to file
+        appendData(c, data, len);
+        slideWindow(c, len);
+        // Segments buffered behind it are now in order too
+        while (c->window_len[c->window_head] > 0) {
+            int slot = c->window_head;
+            appendData(c, &c->window[slot * payload_size], c->window_len[slot]);
+            slideWindow(c, c->window_len[slot]);
+        }
+    }
+    // Packet arrived out of order but inside the receive window, so keep it
+    // until the gap before it is filled. Only full segments line up with
+    // the slots, which is all a sender produces before its last segment.
+    else if (len > 0 && offset % payload_size == 0 && offset < (uint64_t)c->window_slots * payload_size) {
+        if (c->window.empty())
+            c->window.resize(c->window_slots * payload_size);
+        int slot = (c->window_head + offset / payload_size) % c->window_slots;
+        memcpy(&c->window[slot * payload_size], data, len);
+        c->window_len[slot] = len;
+    }
+    // Anything else was delivered already and is just acknowledged again
+
+    // packet to client it lost, need to resend
+    if (h.ack_num == c->pack.pack_header.seq_num) {} 
+    // packet sent to client is in order
+    else if (h.ack_num == c->pack.pack_header.seq_num + 1)
+        c->pack.pack_header.seq_num += 1;
+    // Set flag to ack
+    c->pack.pack_header.flags = 4;
     
-    // Parse port number from command line
-    int port_no = atoi(argv[1]);
-    if (port_no <= 0 || port_no > 65536)
-        showError("invalid port number\n");
+    // With the option agreed the ACK's payload names the segment it
+    // answers, followed by the ranges past a gap that have arrived, so the
+    // client doesn't send them again; other clients get a bare header
+    if (c->sack) {
+        char sack[8 * (1 + 2 * max_sack_blocks)];
+        int n = putSeq(sack, seq_num, c->wide);
+        n += sackBlocks(c, seq_num, sack + n);
+        memcpy(queueReply(c, c->pack.pack_header, n), sack, n);
+    } else {
+        queueReply(c, c->pack.pack_header, 0);
+    }
+    printPacketInfo("SEND", c->pack.pack_header);
+}
+
+// Handle FIN flag
+void handleFin(const header &h, const struct sockaddr &client_addr, bool wide) {
+    conn_info *c = findConnection(h.id, client_addr, wide);
+    if (c == NULL)
+        return;
+    c->last_active = nowSecs();
+    // Packet arrived in order: every byte before the FIN has been received,
+    // so the file is finished and synced now, whether or not the client's
+    // last ACK makes it here
+    if (h.seq_num == c->pack.pack_header.ack_num) {
+        c->pack.pack_header.ack_num += 1;
+        closeFile(c, true);
+    }
+    // Packet arrived out of order
+    else {}
+    
+    // Update connection flag
+    c->pack.pack_header.flags = 4;
+    
+    // send ACK message to client
+    queueReply(c, c->pack.pack_header, 0);
+    printPacketInfo("SEND", c->pack.pack_header);
+
+    // send FIN message to client
+    header fin = c->pack.pack_header;
+    fin.ack_num = 0;
+    fin.flags   = FIN;
+    queueReply(c, fin, 0);
+    c->isFin = 1;
+
+    printPacketInfo("SEND", fin);
+}
+
+// Handle one datagram of recv_bytes bytes
+void handlePacket(const char *buf, ssize_t recv_bytes, const struct sockaddr &client_addr, socklen_t client_addr_len) {
+    header h;
+    int hdr_len = decodeHeader(buf, recv_bytes, h);
+    // Too short to hold a header, or too long to be one of ours
+    if (hdr_len == 0 || recv_bytes - hdr_len > payload_size)
+        return;
+    bool wide = hdr_len == wide_header_size;
+    const char *data = buf + hdr_len;
+    int len = recv_bytes - hdr_len;
 
+    // Log received packet to stdout
+    printPacketInfo("RECV", h);
+
+    if (h.flags == SYN)
+        handleSyn(h, data, len, client_addr, client_addr_len);
+    else if (h.flags == ACK || h.flags == 0)
+        handleData(h, data, len, client_addr, wide);
+    else if (h.flags == FIN)
+        handleFin(h, client_addr, wide);
+}
+
+// Open and bind a socket on the port, or return -1. With several workers
+// every one binds its own socket with SO_REUSEPORT.
+int openSocket(const char *port, bool reuseport) {
     // Setup socket address info 
     struct addrinfo hints;
     struct addrinfo *server_info, *rp;
@@ -154,11 +888,11 @@ int main(int argc, char* argv[]) {
     hints.ai_flags = AI_PASSIVE;
 
     // Get internet address with specified port number to bind and connect socket
-    int s = getaddrinfo(NULL, argv[1], &hints, &server_info);
+    int s = getaddrinfo(NULL, port, &hints, &server_info);
     if (s != 0)
         showError("failed to get addrinfo\n");
 
-    int socket_fd;
+    int socket_fd = -1;
     /* getaddrinfo() returns a list of address structures.
      Try each address until we successfully bind. */
     for (rp = server_info; rp != NULL; rp = rp->ai_next) {
@@ -169,176 +903,161 @@ int main(int argc, char* argv[]) {
         // Set socket options and the socket level
         int opt = 1;
         setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+        if (reuseport && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) < 0)
+            showError("SO_REUSEPORT is needed for more than one worker\n");
+        // Room for bursts from many clients while packets are being handled
+        int rcvbuf = 8*1024*1024;
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
         // Assign address to unbound socket
         if (bind(socket_fd, rp->ai_addr, rp->ai_addrlen) < 0){
             close(socket_fd);
+            socket_fd = -1;
             continue;
         }
         break;
     }
 
-    // If failed to bind socket, then report error and exit
-    if (rp == NULL)
-        showError("failed to bind socket\n");
-    
     // free server addrinfo struct
     freeaddrinfo(server_info);
+    return socket_fd;
+}
 
-    // Setup struct to read datagrams being sent by clients
-    struct sockaddr client_addr;
-    memset(&client_addr, 0, sizeof(client_addr));
-    socklen_t client_addr_len = sizeof(client_addr);
-    // Initialize buffer
-    packet buffer;
-    memset(&buffer, 0, sizeof(buffer));
+// Receive and answer datagrams on a socket until the server is stopped.
+// Each of the workers hands out its own range of connection IDs.
+void runWorker(int socket_fd, int index, int workers) {
+    int ids = allowed_connections / workers;
+    next_id = index * ids + 1;
+    last_id = (index + 1) * ids;
+
+    server_fd = socket_fd;
+    writer = new disk_writer();
+    writer->backlog = 0;
+    std::thread(runWriter, writer).detach();
+    // Ask for GSO and GRO, kernels that don't know them refuse the option
+    int gso_size = 0;
+    use_gso = setsockopt(socket_fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+    int gro = 1;
+    use_gro = setsockopt(socket_fd, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) == 0;
+
+    // Buffers and addresses for a batch of datagrams. Nothing is cleared
+    // between batches, only the bytes a datagram brought are ever read.
+    int buffer_size = use_gro ? gro_buffer_size : max_packet_size;
+    char *buffers = new char[batch_size * buffer_size];
+    struct sockaddr client_addrs[batch_size];
+    char cmsgs[batch_size][CMSG_SPACE(sizeof(int))];
+    struct iovec iovs[batch_size];
+    struct mmsghdr msgs[batch_size];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < batch_size; i++) {
+        iovs[i].iov_base = buffers + i * buffer_size;
+        iovs[i].iov_len  = buffer_size;
+        msgs[i].msg_hdr.msg_name = &client_addrs[i];
+        msgs[i].msg_hdr.msg_iov  = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (use_gro)
+            msgs[i].msg_hdr.msg_control = cmsgs[i];
+    }
+    // Datagrams are read until none are left, then poll() waits for more
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK);
+    wheel.tick = nowSecs();
 
     // Server is ready to receive datagrams from all clients
     while (true) {
-        
-        // Clear buffer
-        memset(&buffer, 0, sizeof(buffer));
-        // Receive data 
-        ssize_t recv_bytes = recvfrom(socket_fd, &buffer, sizeof(buffer), 0, &client_addr, &client_addr_len);
-        // If recv_bytes is 0, then theres no messages available so just loop back
-        if (recv_bytes == (ssize_t)0)
-            continue;
-        else if (recv_bytes < 0)
-            showError("recvfrom returned -1");
-        
-        // Convert to host byte order
-        changeByteOrder(buffer);
-        
-        // Log received packet to stdout
-        printPacketInfo("RECV", buffer);
-
-        // Handle SYN flag
-        if (buffer.pack_header.flags == SYN) {
-            for (int i=0; i<allowed_connections; i++) {
-                if ((connections[i].src_addr.sa_family != client_addr.sa_family) && 
-                                    (connections[i].pack.pack_header.id == 0)) {
-                    // Setup correct file path based on connection ID
-                    std::string file_path = "./" + std::to_string(i+1) + ".file";
-
-                    /* update connection fields */
-                    // Set flag to SYN ACK
-                    connections[i].pack.pack_header.flags = 6;
-                    // New ack number is current seq number + 1
-                    connections[i].pack.pack_header.ack_num = buffer.pack_header.seq_num + 1;
-                    // Initialize random sequence number
-                    srand(time(NULL)+getpid());
-                    int seqNum = rand() % max_seq_num;
-                    connections[i].pack.pack_header.seq_num = seqNum;
-                    // Increment packet header ID
-                    connections[i].pack.pack_header.id = i + 1;
-                    connections[i].src_addr = client_addr;
-                    connections[i].addr_len = client_addr_len;
-                    // Open file to store data in
-                    connections[i].file.open(file_path);
-                    
-                    /* update buffer fields */
-                    updateBuffer(buffer, i);
-
-                    // send message to client //
-                    sendto(socket_fd, &buffer, sizeof(connections[i].pack), 0, &connections[i].src_addr, connections[i].addr_len);
-                    printPacketInfo("SEND", connections[i].pack);
+        // Wake up at least once a second to drop idle connections
+        struct pollfd pfd;
+        pfd.fd = socket_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+            showError("poll returned -1");
+        expireConnections();
 
-                    break;
-                }
-                else {
-                    sendto(socket_fd, &buffer, sizeof(connections[i].pack), 0, &connections[i].src_addr, connections[i].addr_len);
-                }
+        while (true) {
+            for (int i = 0; i < batch_size; i++) {
+                msgs[i].msg_hdr.msg_namelen = sizeof(client_addrs[i]);
+                if (use_gro)
+                    msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i]);
             }
-        }
-        
-        // Handle ACK flag
-        /* Find connection with same ID as in the packet, compare seq_num with ack_num. If they
-        are matching, then the packet arrived in order. Send packet back with id, updated ack and 
-        seq numbers */
-        else if (buffer.pack_header.flags == ACK || buffer.pack_header.flags == 0) {
-            for (int i=0; i<allowed_connections; i++) {
-                if (buffer.pack_header.id == connections[i].pack.pack_header.id) {
-                    // If fin flag, then close/save file
-                    if (connections[i].isFin) {
-                        connections[i].file.close();
-                        break;
-                    }
-                    // Packet arrived in order
-                    if (buffer.pack_header.seq_num == connections[i].pack.pack_header.ack_num) {
-                        // Increment ack number by payload size - 12 bytes for header
-                        connections[i].pack.pack_header.ack_num += recv_bytes-12;
-                        // Incase it overflows past maximum, start counting from 0
-                        connections[i].pack.pack_header.ack_num %= max_seq_num;
-
-                        // packet to client it lost, need to resend
-                        if (buffer.pack_header.ack_num == connections[i].pack.pack_header.seq_num) {} 
-                        // packet sent to client is in order
-                        else if (buffer.pack_header.ack_num == connections[i].pack.pack_header.seq_num + 1)
-                            connections[i].pack.pack_header.seq_num += 1;
-                        //write data to file and clear write buffer
-                        connections[i].file.write(buffer.data, recv_bytes-12);
-                        connections[i].file.flush();
-                    }
-                    // Packet arrived out of order
-                    else {
-                        // Packet to client is lost, need to resend
-                        if (buffer.pack_header.ack_num == connections[i].pack.pack_header.seq_num) {}
-                        // Packet sent to client is in order
-                        else if (buffer.pack_header.ack_num == connections[i].pack.pack_header.seq_num + 1)
-                            connections[i].pack.pack_header.seq_num += 1;
+            // Receive data 
+            int n = recvmmsg(socket_fd, msgs, batch_size, 0, NULL);
+            // No more messages available, wait for the next ones
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                break;
+            else if (n < 0)
+                showError("recvmmsg returned -1");
+
+            for (int i = 0; i < n; i++) {
+                char *data = (char *)iovs[i].iov_base;
+                ssize_t recv_bytes = msgs[i].msg_len;
+                // Datagrams coalesced by GRO follow each other in the
+                // buffer, all of segment bytes but maybe the last
+                ssize_t segment = recv_bytes;
+                if (use_gro) {
+                    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL;
+                         cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                            int size;
+                            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                            if (size > 0)
+                                segment = size;
+                        }
                     }
-                    // Set flag to ack
-                    connections[i].pack.pack_header.flags = 4;
-                    
-                    // Update buffer fields
-                    updateBuffer(buffer, i);
-
-                    // send message to client
-                    sendto(socket_fd, &buffer, sizeof(connections[i].pack), 0, &connections[i].src_addr, connections[i].addr_len);
-                    printPacketInfo("SEND", connections[i].pack);
-                    break;
-                }
-            }
-        } 
-        
-        // Handle FIN flag
-        else if (buffer.pack_header.flags == FIN) {
-            for (int i=0; i<allowed_connections; i++) {
-                if (buffer.pack_header.id == connections[i].pack.pack_header.id) {
-                    // Packet arrived in order
-                    if (buffer.pack_header.seq_num == connections[i].pack.pack_header.ack_num)
-                        connections[i].pack.pack_header.ack_num += 1;
-                    // Packet arrived out of order
-                    else {}
-                    
-                    // Update connection flag
-                    connections[i].pack.pack_header.flags = 4;
-                    
-                    // Update buffer fields
-                    updateBuffer(buffer, i);
-                    
-                    // send ACK message to client
-                    sendto(socket_fd, &buffer, sizeof(connections[i].pack), 0, &connections[i].src_addr, connections[i].addr_len);
-                    printPacketInfo("SEND", connections[i].pack);
-
-                    // Update buffer for FIN message
-                    buffer.pack_header.seq_num = htonl(connections[i].pack.pack_header.seq_num);
-                    uint32_t ack_num = 0;
-                    buffer.pack_header.ack_num = htonl(ack_num);
-                    buffer.pack_header.id      = htons(connections[i].pack.pack_header.id);
-                    uint16_t fin = 1;
-                    buffer.pack_header.flags   = htons(fin);
-
-                    // send ACK message to client
-                    sendto(socket_fd, &buffer, sizeof(connections[i].pack), 0, &connections[i].src_addr, connections[i].addr_len);
-                    connections[i].isFin = 1;
-
-                    // convert back to host byte order so we can print it
-                    changeByteOrder(buffer);
-
-                    printPacketInfo("SEND", buffer);
-                    break;
                 }
+                for (ssize_t off = 0; off < recv_bytes; off += segment)
+                    handlePacket(data + off, std::min(segment, recv_bytes - off),
+                                 client_addrs[i], msgs[i].msg_hdr.msg_namelen);
             }
+            // Answer the whole batch at once, and write out its log lines
+            flushReplies();
+            flushLog();
         }
     }
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[]) {
+    // Setup signal handler
+    if (signal(SIGINT, sighandler) == SIG_ERR) 
+        showError("could not setup signal handler\n");
+    
+    // Number of worker threads, each with its own socket and connections
+    int workers = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't')
+            workers = atoi(optarg);
+        else
+            showError("usage - ./server [-t <threads>] <port_no>\n");
+    }
+    if (workers < 1 || workers > 256)
+        showError("number of threads must be between 1 and 256\n");
+
+    // Ensure port number is passed in as argument
+    if (argc - optind != 1)
+        showError("provide port number - ./server [-t <threads>] <port_no>\n");
+    
+    // Parse port number from command line
+    const char *port = argv[optind];
+    int port_no = atoi(port);
+    if (port_no <= 0 || port_no > 65536)
+        showError("invalid port number\n");
+
+    // Bind every socket before any worker starts, so that the kernel spreads
+    // clients over the same set of sockets from the first datagram on
+    std::vector<int> sockets;
+    for (int i = 0; i < workers; i++) {
+        int socket_fd = openSocket(port, workers > 1);
+        // If failed to bind socket, then report error and exit
+        if (socket_fd == -1)
+            showError("failed to bind socket\n");
+        sockets.push_back(socket_fd);
+    }
+
+    raiseFileLimit();
+    // seed the initial sequence numbers once
+    srand(time(NULL)+getpid());
+
+    // The main thread is the first worker
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+        threads.push_back(std::thread(runWorker, sockets[i], i, workers));
+    runWorker(sockets[0], 0, workers);
+}